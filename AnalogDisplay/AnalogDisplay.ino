@@ -151,12 +151,18 @@ void setup() {
   Serial.begin(115200);
   setupPorts();
   
+  setupBusMaster();
+  setupBusMonitor();
+  setupGateway();
   resetBusMaster();
   resetInput();
   resetOutput();
   resetS88();
   checkInitEEPROM();
   loadAll();
+  compileS88Chains();
+  compileSensorMap();
+  compileLogic();
   initTerminal();
 
   registerLineCommand("EDMP", &commandDumpEEProm);
@@ -165,6 +171,7 @@ void setup() {
   registerLineCommand("SAV", &commandSave);
   registerLineCommand("FTR", &commandFeature);
   registerLineCommand("INF", &commandInfo);
+  setupEventRecorder();
 
 //  testCommunication();
 
@@ -178,6 +185,7 @@ void resetAll() {
   eeData = EEData();
   resetInput();
   resetOutput();
+  compileS88Chains();
 }
 
 void saveAll() {
@@ -212,7 +220,7 @@ void shiftIORow() {
   if ((rowStep % 8) == 0) {
 //    processInputRow();
   }
-  ioRowIndex = (ioRowIndex + 1) % 8;
+  ioRowIndex = (ioRowIndex + 1) % outputRows;
   if (ioRowIndex == 0) {
     rowStep++;
   }
@@ -227,7 +235,7 @@ void loop() {
     
   shiftIORow();
   updateTime();
-//  transmitFrames();
+  transmitFrames();
 
   updateTime();
   processS88Bus();
@@ -235,6 +243,7 @@ void loop() {
   updateTime();
   flipFlashes();
   processTerminal();
+  processGateway();
 }
 
 void commandClear() {
@@ -277,8 +286,13 @@ void commandSave() {
 
 void commandDumpAll() {
   commandFlashDump();
+  dumpSensorMap();
+  dumpLogic();
   commandShowKeys();
   dumpTrackSensitivity();
+  dumpS88Chains();
+  dumpS88Publish();
+  dumpBusGroups();
   printFeatures();
 }
 
@@ -27,6 +27,50 @@
  * (uspesne odeslano, cekani, opakovani) se volajicimu neoznamuje; je nutne vycist z fronty. Je NUTNE periodicky volat 
  *    void transmitFrames();
  * ktera si ridi prijem i vysilani, a pocita timeouty. Po dosazeni konce fronty odesilanych zprav a uplynuti timeoutu 
+ * 
+ * Broadcast (`addressBroadcast`) nikdo nepotvrzuje; packet se po odvysilani z fronty vyradi.
+ * 
+ * Skupiny: adresa `addressGroupBase` + g oznacuje skupinu g; clenove skupin se definuji prikazem GRP a ukladaji v EEData. Packet pro skupinu
+ * se vysle jen jednou. Data packetu zacinaji 2 byte bitove masky clenu (bit = adresa slave, LSB prvni), za nimi nasleduji vlastni data.
+ * Slave, ktery je v masce, potvrdi packet obvyklym ACK, ale az ve "svem" casovem slotu: poradi slotu je poradi jeho bitu mezi nastavenymi
+ * bity masky, slot trva `groupAckSlot` ms od konce packetu. Master sbira ACK, dokud neodpovi vsichni nebo neuplyne posledni slot. Pri opakovani
+ * se v packetu ponechaji jen clenove, kteri nepotvrdili - ostatni packet ignoruji.
+ * 
+ * Priority: kazdy packet ma tridu priority (BusPriority). Ze zatim nezpracovanych packetu se vzdy vysila ten s nejvyssi tridou, ve stejne tride
+ * v poradi zarazeni (viz `selectPacket`). Packet muze mit lhutu (deadline); po jejim uplynuti se nevysle a z fronty se vyradi. Packet se
+ * priznakem `supersede` nahradi novejsi packet pro stejny cil se stejnymi prvnimi 2 byte dat (operace, cislo prikazu), dokud neni odeslan -
+ * fronta tak neposila zastaraly stav. U 2 byte dat `opKeyCommand` se neporovnava nejvyssi bit druheho byte (stav v kompaktnim prikazu, `encodeKeyCommand`). Je-li fronta plna, uvolni misto packety s nizsi prioritou.
+ * 
+ * Casovani: pro kazdeho slave se meri doba od konce packetu do prijeti ACK (RTT) a z vyhlazeneho RTT a jeho odchylky se pocita, jak dlouho se ceka
+ * na zacatek ACK (srtt + 4 * rttvar, viz TCP). Rychly slave tak po nekolika ms vyprsi misto celeho `ackTimeout`. Opakovany packet se pro mereni
+ * nepouzije, nelze poznat, na ktere vyslani ACK prislo. Po kazde dalsi chybe se zdvojnasobi prodleva pred opakovanim packetu danemu slave
+ * (`minRepeatDelay` << (backoff - 1)), po uspesnem ACK se vrati na minimum. Statistiky spojeni vypise prikaz BUS.
+ * 
+ * Stav slave: po chybe je slave "podezrely" (suspect), pokud packet nedoruci ani po `maxPacketRepeats` opakovanich, je "mrtvy" (down). Packety
+ * pro mrtveho slave se nevysilaji: s prioritou `prioUrgent` zustanou odlozene ve fronte do sve lhuty (bez lhuty nejvyse `maxDeadline` ms),
+ * ostatni se hned zahodi. Jeden mrtvy slave tak nezaplni frontu ostatnim.
+ * Jednou za `probePeriod` ms se jednomu mrtvemu slave posle kratky packet `opProbe` (bez opakovani); kdyz ho potvrdi, slave je opet "zivy"
+ * a odlozene packety se odeslou v nejblizsim cyklu opakovani; sketch muze v `onSlaveUp` poslat slave aktualni stav. Stav slave vypise prikaz SLV.
+ * 
+ * Vice masteru: sdili-li sbernici vice masteru (prikaz MST), smi packety zahajovat jen ten, kdo drzi pesek (token). Pesek se predava kratkym packetem
+ * `opToken` (bez ACK) dalsimu masteru v poradi adres, dokola. Drzitel zahajuje packety nejvyse `tokenHoldTime` ms; nema-li co vysilat (nebo ceka
+ * na opakovani), preda pesek po `tokenIdleTime` ms. Predani potvrdi naslednik tim, ze cokoliv vysle. Pokud do `tokenPassTimeout` ms nevysila, predani
+ * se zopakuje, po `tokenPassRepeats` pokusech je naslednik "mrtvy" a pesek dostane dalsi master; mrtvy master dostane pesek na zkousku jednou za
+ * `probePeriod` ms, nebo se vrati, kdyz jej master uslysi vysilat. Je-li sbernice `tokenLostTime` + adresa * `tokenClaimSlot` ms v klidu, pesek se ztratil
+ * a master si jej vezme sam - jako prvni ten s nejnizsi adresou. Uslysi-li drzitel vysilat jiny master, pesek zahodi; zdvojeny pesek tak zanikne a po
+ * tichu se obnovi. Packet tak ceka na vysilani nejvyse zhruba (pocet masteru - 1) * (`tokenHoldTime` + jedna vymena s ACK + predani pesku).
+ * Bez definovanych masteru se pesek nepouziva.
+ *
+ * Zpetna hlaseni: slave muze v ACK na packet pro svou adresu (ne ve slotu skupiny - ten je na delsi ACK kratky) za checksum pripojit stav - zmeny svych hlaseni (poloha vyhybky, navestidla) od posledniho ACK, po 1 byte
+ * [stav << 7 | cislo hlaseni], nejvyse `maxAckStatus` byte. Cislo `feedbackMore` znamena, ze dalsi zmeny se do ACK nevesly. Master hlaseni zapise
+ * do tabulky `slaveFeedback` (`maxFeedbackBits` na slave, cte `readFeedback`) a kazdou zmenu ohlasi sketchi pres `onSlaveFeedback`. Slave
+ * z `feedbackSlaves` (prikaz FBK) se master, kdyz nema co vysilat, jednou za `feedbackPollPeriod` ms zepta kratkym packetem `opProbe`, slave
+ * s `feedbackMore` hned. Hlaseni tak prijdou i bez povelu, a dotazy nezdrzuji packety z fronty.
+ *
+ * Slozeny byte delky (kod operace v hornich bitech, viz RS485Frame) se posila jen slave z `foldSlaves` (prikaz FOLD), skupine jen,
+ * rozumi-li mu vsichni clenove. Ostatni dostavaji obycejny byte delky.
+ * 
+ * V rezimu analyzatoru (BusMonitor) `transmitFrames` nevysila, jen predava prijate ramce analyzatoru; `addMessage` zpravy zahazuje.
  */
 
 const boolean debugBusMaster = false;
@@ -34,10 +78,21 @@ const boolean debugBusMaster = false;
 const boolean printErrors = true;
 
 /**
- * Doba cekani na ACK. Pote je packet povazovany za nedoruceny, a bude se opakovat.
+ * Doba cekani na ACK, dokud neni zmereny RTT slave; zaroven horni mez adaptivniho timeoutu. Pote je packet povazovany za nedoruceny, 
+ * a bude se opakovat. Prijimac sam ceka na start byte nejvyse `recvDelayStartByte`.
  */
 const int ackTimeout = 50;
 
+/**
+ * Dolni mez adaptivniho timeoutu ACK [ms]
+ */
+const int minAckTimeout = 3;
+
+/**
+ * Max. exponent prodlevy pred opakovanim
+ */
+const byte maxBackoff = 3;
+
 /**
  * Max pocet opakovani. Po dosazeni se packet VYRADI.
  */
@@ -50,10 +105,35 @@ const int msgBufferSize = 160;
 
 
 /**
- * Max pocet obsluhovanych zarizeni - pro vypocet velikosti poli
+ * Max pocet obsluhovanych zarizeni - pro vypocet velikosti poli. Nejvys 16 (adresy 0-15): masky slave (skupiny, mastery, stav
+ * spojeni) jsou 16bitove a od `addressGroupBase` zacinaji adresy skupin.
  */
 const int maxSlaves = 16;
-const int maxSlaves8 = (maxSlaves + 7) / 8;
+
+/**
+ * Pocet adres (slave + skupiny), pro ktere se eviduje blokovani
+ */
+const int maxAddress = addressGroupBase + maxBusGroups;
+const int maxAddress8 = (maxAddress + 7) / 8;
+
+static_assert(maxSlaves <= addressGroupBase, "Slave addresses overlap groups");
+static_assert(maxSlaves <= 16, "Group member mask has just 16 bits");
+
+/**
+ * Delka slotu pro ACK jednoho clena skupiny [ms]. Musi pojmout zpozdeni odpovedi slave a ACK ramec (5 byte = cca 5ms pri 9600Bd).
+ */
+const int groupAckSlot = 8;
+
+/**
+ * Delka masky clenu na zacatku dat skupinoveho packetu
+ */
+const byte groupHeaderSize = 2;
+
+/**
+ * Jednotka casu pro deadline packetu [ms]. Deadline ma 8 bitu, takze lhuta muze byt nejvyse 127 jednotek.
+ */
+const int deadlineTick = 32;
+const unsigned int maxDeadline = 127 * deadlineTick;
 
 /**
  * Doba po kterou se smi nepretrzite vysilat. Po uplynuti se vysilani prerusi,
@@ -66,6 +146,63 @@ const int maxTransmitTime = 30;
  */
 const int minRepeatDelay = 20;
 
+/**
+ * Perioda zkusebnich packetu pro mrtve slave [ms]
+ */
+const int probePeriod = 1000;
+
+/**
+ * Nejdelsi doba [ms], po kterou master s peskem zahajuje packety; rozpracovana vymena se dokonci.
+ */
+const int tokenHoldTime = 50;
+
+/**
+ * Jak dlouho [ms] si master pesek ponecha, nema-li co vysilat
+ */
+const int tokenIdleTime = 10;
+
+/**
+ * Do kdy [ms] od predani pesku musi naslednik zacit vysilat
+ */
+const int tokenPassTimeout = tokenIdleTime + recvDelayStartByte;
+
+/**
+ * Pocet pokusu o predani pesku jednomu naslednikovi
+ */
+const byte tokenPassRepeats = 2;
+
+/**
+ * Klid na sbernici [ms], po kterem se pesek povazuje za ztraceny. Master s adresou A ceka navic A * `tokenClaimSlot` ms.
+ * Musi byt delsi nez nejdelsi ticho pri beznem provozu (cekani na ACK, predani pesku).
+ */
+const int tokenLostTime = 100;
+const int tokenClaimSlot = 10;
+
+/**
+ * Pocet zpetnych hlaseni (bitu) od jednoho slave; nasobek 8
+ */
+const byte maxFeedbackBits = 16;
+const byte feedbackSlaveBytes = maxFeedbackBits / 8;
+
+/**
+ * Polozka stavu v ACK: dalsi zmeny cekaji, slave se ma zeptat znovu
+ */
+const byte feedbackMore = 0x7f;
+
+/**
+ * Nejvic byte stavu za checksum v ACK
+ */
+const byte maxAckStatus = recvBufferSize - (sizeof(len_t) + 2 * sizeof(address_t)) - checksumSize;
+
+/**
+ * Perioda dotazu na zpetna hlaseni, kdyz neni co vysilat [ms]; kazdou periodu se master zepta jednoho slave
+ */
+const int feedbackPollPeriod = 20;
+
+static_assert(maxFeedbackBits % 8 == 0 && maxFeedbackBits <= feedbackMore, "Bad feedback size");
+
+static_assert(tokenLostTime > ackTimeout + recvDelayBetweenPacketBytes && tokenLostTime > tokenPassTimeout, "Token would be claimed during normal operation");
+
 /**
    Maximum size of stalled data. If more data is not delivered
    to the slaves, the least recent stalled packet should be trashed.
@@ -90,17 +227,145 @@ byte *msgBufferHead = msgBuffer;
 
 CommFrame*  sendPacket = (CommFrame*)msgBuffer;
 
-byte  blockedSlaves[maxSlaves8];
-byte  failedSlaves[maxSlaves8];
+byte  blockedSlaves[maxAddress8];
+byte  failedSlaves[maxAddress8];
 
 byte &busMasterId = eeData.busId;
 
+/**
+ * Clenove skupin, bitove masky adres slave
+ */
+unsigned int (&busGroups)[maxBusGroups] = eeData.busGroups;
+
+/**
+ * Mastery sdilejici sbernici, bitova maska adres; 0 nebo jen vlastni adresa = jediny master
+ */
+unsigned int &busMasters = eeData.busMasters;
+
+enum TokenState {
+  tokenNone = 0,  // pesek ma jiny master
+  tokenHeld,      // smi se vysilat
+  tokenPassed     // pesek predan, ceka se, az naslednik zacne vysilat
+};
+
+byte tokenState = tokenNone;
+
+/**
+ * Naslednik, kteremu se predava pesek, pocet pokusu; `tokenProbe` = zkouska mrtveho masteru
+ */
+byte tokenTarget;
+byte tokenTries;
+boolean tokenProbe;
+
+/**
+ * Prave se vysila packet s peskem (ne z fronty)
+ */
+boolean tokenXmit = false;
+
+/**
+ * Ziskani pesku, posledni zahajeny packet, konec vysilani pesku, posledni zkouska mrtveho masteru
+ */
+unsigned int tokenHoldStart;
+unsigned int tokenUseTime;
+unsigned int tokenPassStart;
+unsigned int masterProbeStart;
+
+/**
+ * Mastery, kteri neprevzali pesek
+ */
+unsigned int mastersDown;
+
+unsigned int tokenPasses;
+unsigned int tokenClaims;
+
+CommFrame tokenFrame;
+
+/**
+ * Slave, kterych se master pta na zpetna hlaseni, bitova maska adres
+ */
+unsigned int &feedbackSlaves = eeData.feedbackSlaves;
+
+/**
+ * Slave, ktere rozumi slozenemu byte delky, bitova maska adres
+ */
+unsigned int &foldSlaves = eeData.foldSlaves;
+
+/**
+ * Zpetna hlaseni slave, bit = hlaseni
+ */
+byte slaveFeedback[maxSlaves][feedbackSlaveBytes];
+
+/**
+ * Slave, ktere v ACK ohlasily dalsi cekajici zmeny
+ */
+unsigned int feedbackPending;
+
+/**
+ * Posledni dotazovany slave, cas posledniho dotazu, statistika
+ */
+byte feedbackPollSlave;
+unsigned int feedbackPollStart;
+unsigned int feedbackChanges;
+unsigned int feedbackPolls;
+
+/**
+ * Clenove skupiny, kteri jeste nepotvrdili prave vyslany packet
+ */
+unsigned int groupPending;
+
+/**
+ * Zacatek a delka cekani na ACK od clenu skupiny
+ */
+unsigned int groupAckStart;
+unsigned int groupAckWindow;
+
+/**
+ * Slave, ktere neodpovedely na posledni packet; slave, ktere nepotvrdily packet ani po vsech opakovanich
+ */
+unsigned int slavesSuspect;
+unsigned int slavesDown;
+
+/**
+ * Posledni zkouseny slave a cas zkousky
+ */
+byte probeSlave;
+unsigned int probeStart;
+
+/**
+ * Statistika a casovani spojeni s jednim slave. Casy v mikrosekundach.
+ */
+struct SlaveLink {
+  unsigned int frames;
+  unsigned int retries;
+  unsigned int timeouts;
+  unsigned int errors;
+  /**
+   * Vyhlazeny RTT a jeho odchylka; srtt == 0 - jeste nezmereno
+   */
+  unsigned int srtt;
+  unsigned int rttvar;
+  unsigned int rttMin;
+  unsigned int rttMax;
+  /**
+   * Cas posledni chyby [ms], od nej se pocita prodleva pred opakovanim
+   */
+  unsigned int retryStart;
+  byte backoff;
+};
+
+SlaveLink slaveLinks[maxSlaves];
+
 /**
  *  Slave, kteremu se odeslala posledni data, 
  *  pro kontrolu ACK
  */
 address_t xmitTarget;
 
+/**
+ * Konec vysilani posledniho packetu, pro mereni RTT
+ */
+unsigned long xmitEndMicros;
+
 /**
  * V modulu RS485; XOR/CRC checksum zaslany v packetu
  * do slave, mel by prijit v ACK.
@@ -114,8 +379,25 @@ void clearBlockedSlaves() {
   for (int i = 0; i < sizeof(blockedSlaves); blockedSlaves[i] = failedSlaves[i]= 0, i++) ;
 }
 
+void setupBusMaster() {
+  registerLineCommand("GRP", &commandBusGroup);
+  registerLineCommand("BUS", &commandBusStats);
+  registerLineCommand("SLV", &commandSlaves);
+  registerLineCommand("MST", &commandBusMasters);
+  registerLineCommand("FBK", &commandFeedback);
+  registerLineCommand("FOLD", &commandFoldSlaves);
+}
+
 void resetBusMaster() {
   clearBlockedSlaves();
+  memset(slaveLinks, 0, sizeof(slaveLinks));
+  slavesSuspect = slavesDown = 0;
+  mastersDown = 0;
+  tokenState = tokenNone;
+  tokenPasses = tokenClaims = 0;
+  memset(slaveFeedback, 0, sizeof(slaveFeedback));
+  feedbackPending = 0;
+  feedbackChanges = feedbackPolls = 0;
   sendPacket = NULL;
   busMasterId = 1;
 }
@@ -127,10 +409,10 @@ void skipPacket() {
     Serial.println(F("Queue packet"));
   }
   printBufStat();
-  if (msgBufferHead < sendPacket) {
+  if (msgBufferHead < (byte*)sendPacket) {
     if (debugBusMaster) {
       sendPacket->printStat();
-      Serial.print(F("Moving blocked ")); Serial.print((int)sendPacket, HEX); Serial.print(':'); Serial.print((int)msgBufferHead, HEX); 
+      Serial.print(F("Moving blocked ")); Serial.print((uintptr_t)sendPacket, HEX); Serial.print(':'); Serial.print((uintptr_t)msgBufferHead, HEX); 
       Serial.print('-'); Serial.println(l); 
     }
     memmove(msgBufferHead, sendPacket, l);
@@ -150,10 +432,10 @@ void printBufStat() {
   if (!debugBusMaster) {
     return;
   }
-  Serial.print(F("Bufstat, start= ")); Serial.print((int)msgBuffer, HEX); 
-  Serial.print(F(" end=")); Serial.print((int)msgBufferTop, HEX);
-  Serial.print(F(" head=")); Serial.print((int)msgBufferHead, HEX);
-  Serial.print(F(" send=")); Serial.print((int)sendPacket, HEX); Serial.print(F(" next=")); Serial.println((sendPacket != NULL) ? (int)sendPacket->next() : 0, HEX);
+  Serial.print(F("Bufstat, start= ")); Serial.print((uintptr_t)msgBuffer, HEX); 
+  Serial.print(F(" end=")); Serial.print((uintptr_t)msgBufferTop, HEX);
+  Serial.print(F(" head=")); Serial.print((uintptr_t)msgBufferHead, HEX);
+  Serial.print(F(" send=")); Serial.print((uintptr_t)sendPacket, HEX); Serial.print(F(" next=")); Serial.println((sendPacket != NULL) ? (uintptr_t)sendPacket->next() : 0, HEX);
 }
 
 void checkAndRepeatFailed() {
@@ -165,7 +447,7 @@ void checkAndRepeatFailed() {
   if (msgBufferTop <= msgBuffer) {
     return;
   }
-  clearBlockedSlaves();
+  unblockSlaves();
   if (msgBufferTop > msgBuffer) {
     sendPacket = (CommFrame*)msgBuffer;
   } else {
@@ -177,6 +459,328 @@ void checkAndRepeatFailed() {
   }
 }
 
+/**
+ * Odblokuje slave, kterym uz uplynula prodleva pred opakovanim.
+ */
+void unblockSlaves() {
+  for (byte t = 0; t < maxAddress; t++) {
+    if ((t < maxSlaves) && !backoffElapsed(t)) {
+      continue;
+    }
+    writeBit(blockedSlaves, t, 0);
+  }
+  memset(failedSlaves, 0, sizeof(failedSlaves));
+}
+
+boolean backoffElapsed(byte t) {
+  const SlaveLink& l = slaveLinks[t];
+  unsigned int s = l.retryStart;
+  return (l.backoff <= 1) || elapsedTime(s, minRepeatDelay << (l.backoff - 1));
+}
+
+/**
+ * Timeout pro zacatek ACK od slave, mikrosekundy
+ */
+unsigned int slaveAckTimeout(byte t) {
+  if (t >= maxSlaves) {
+    return ackTimeout * 1000U;
+  }
+  const SlaveLink& l = slaveLinks[t];
+  if (l.srtt == 0) {
+    return ackTimeout * 1000U;
+  }
+  unsigned long tm = l.srtt + 4UL * l.rttvar;
+  if (tm < minAckTimeout * 1000UL) {
+    return minAckTimeout * 1000U;
+  }
+  return min(tm, ackTimeout * 1000UL);
+}
+
+/**
+ * Slave potvrdil packet. `rtt` = 0, pokud se nema merit (opakovany nebo skupinovy packet).
+ */
+void linkAck(byte t, unsigned long rtt) {
+  if (t >= maxSlaves) {
+    return;
+  }
+  SlaveLink& l = slaveLinks[t];
+  l.backoff = 0;
+  if (slavesDown & (1U << t)) {
+    if (printErrors) {
+      Serial.print(F("Slave up: ")); Serial.println(t);
+    }
+    writeBit(blockedSlaves, t, 0);
+    slavesDown &= ~(1U << t);
+    onSlaveUp(t);
+  }
+  slavesSuspect &= ~(1U << t);
+  if ((rtt == 0) || (rtt > 0xffff)) {
+    return;
+  }
+  unsigned int r = rtt;
+  if (l.srtt == 0) {
+    l.srtt = r;
+    l.rttvar = r / 2;
+    l.rttMin = l.rttMax = r;
+    return;
+  }
+  // RTT az 65 ms; rozdil se do 16bitoveho int nevejde
+  long err = (long)r - l.srtt;
+  long dev = (err < 0) ? -err : err;
+  l.srtt += err / 8;
+  l.rttvar += (dev - (long)l.rttvar) / 4;
+  l.rttMin = min(l.rttMin, r);
+  l.rttMax = max(l.rttMax, r);
+}
+
+/**
+ * Slave nepotvrdil packet: timeout nebo chybna odpoved.
+ */
+void linkFailed(byte t, boolean timeout) {
+  if (t >= maxSlaves) {
+    return;
+  }
+  SlaveLink& l = slaveLinks[t];
+  if (timeout) {
+    l.timeouts++;
+  } else {
+    l.errors++;
+  }
+  if (l.backoff < maxBackoff) {
+    l.backoff++;
+  }
+  slavesSuspect |= (1U << t);
+  recordStartTime(l.retryStart);
+}
+
+boolean isSlaveDown(byte t) {
+  return (t < maxSlaves) && (slavesDown & (1U << t));
+}
+
+boolean isProbe(const CommFrame& f) {
+  return (f.len == 1) && (f.dataStart == opProbe);
+}
+
+void markSlaveDown(byte t) {
+  if ((t >= maxSlaves) || isSlaveDown(t)) {
+    return;
+  }
+  if (printErrors) {
+    Serial.print(F("Slave down: ")); Serial.println(t);
+  }
+  slavesDown |= (1U << t);
+  slavesSuspect &= ~(1U << t);
+}
+
+/**
+ * Jednou za `probePeriod` zaradi zkusebni packet pro dalsiho mrtveho slave.
+ */
+void probeDownSlaves() {
+  if (slavesDown == 0) {
+    recordStartTime(probeStart);
+    return;
+  }
+  if (!elapsedTime(probeStart, probePeriod)) {
+    return;
+  }
+  do {
+    probeSlave = (probeSlave + 1) % maxSlaves;
+  } while (!isSlaveDown(probeSlave));
+  byte msg = opProbe;
+  addMessage(probeSlave, busMasterId, &msg, 1, prioLow, probePeriod, false);
+}
+
+/**
+ * Zapise zpetna hlaseni z ACK slave `t`
+ */
+void applyAckStatus(byte t, const byte* status, byte len) {
+  if (t >= maxSlaves) {
+    return;
+  }
+  for (; len > 0; len--, status++) {
+    byte n = *status & 0x7f;
+    boolean st = (*status & 0x80) != 0;
+    if (n == feedbackMore) {
+      feedbackPending |= (1U << t);
+      continue;
+    }
+    if ((n >= maxFeedbackBits) || (readBit(slaveFeedback[t], n) == st)) {
+      continue;
+    }
+    writeBit(slaveFeedback[t], n, st);
+    feedbackChanges++;
+    onSlaveFeedback(t, n, st);
+  }
+}
+
+boolean readFeedback(byte t, byte n) {
+  return (t < maxSlaves) && (n < maxFeedbackBits) && readBit(slaveFeedback[t], n);
+}
+
+/**
+ * Nema-li master co vysilat, zaradi dotaz na zpetna hlaseni dalsiho slave: hned slave s cekajicimi zmenami,
+ * jinak jednou za `feedbackPollPeriod`.
+ */
+void pollFeedback() {
+  unsigned int polled = (feedbackSlaves | feedbackPending) & ~slavesDown;
+  if (polled == 0) {
+    return;
+  }
+  if (feedbackPending & polled) {
+    polled &= feedbackPending;
+  } else if (!elapsedTime(feedbackPollStart, feedbackPollPeriod)) {
+    return;
+  }
+  do {
+    feedbackPollSlave = (feedbackPollSlave + 1) % maxSlaves;
+  } while (!(polled & (1U << feedbackPollSlave)));
+  feedbackPending &= ~(1U << feedbackPollSlave);
+  feedbackPolls++;
+  byte msg = opProbe;
+  addMessage(feedbackPollSlave, busMasterId, &msg, 1, prioLow, feedbackPollPeriod, false);
+}
+
+boolean isMultiMaster() {
+  return (busMasters & ~(1U << busMasterId)) != 0;
+}
+
+boolean isMasterFrame(const CommFrame& f) {
+  return (f.from < maxSlaves) && (f.from != busMasterId) && (busMasters & (1U << f.from));
+}
+
+/**
+ * Dalsi master za timto v poradi adres; jen zivi, nebo jen mrtvi (`down`). Vlastni adresa, pokud zadny neni.
+ */
+byte nextMaster(boolean down) {
+  unsigned int m = busMasters & (down ? mastersDown : ~mastersDown);
+  for (byte i = 1; i < maxSlaves; i++) {
+    byte a = (busMasterId + i) % maxSlaves;
+    if (m & (1U << a)) {
+      return a;
+    }
+  }
+  return busMasterId;
+}
+
+void acquireToken() {
+  tokenState = tokenHeld;
+  recordStartTime(tokenHoldStart);
+  recordStartTime(tokenUseTime);
+}
+
+void sendToken(byte t) {
+  tokenFrame.from = busMasterId;
+  tokenFrame.to = t;
+  tokenFrame.len = 1;
+  tokenFrame.dataStart = opToken;
+  tokenTarget = t;
+  tokenState = tokenPassed;
+  tokenXmit = true;
+  tokenPasses++;
+  if (debugBusMaster) {
+    Serial.print(F("Token to ")); Serial.println(t);
+  }
+  transmitFrame(&tokenFrame, foldsLength(tokenFrame));
+}
+
+/**
+ * Preda pesek dalsimu zivemu masteru, jednou za `probePeriod` zkusi mrtveho.
+ */
+void passToken() {
+  tokenProbe = false;
+  byte t = nextMaster(false);
+  if ((mastersDown & busMasters) && elapsedTime(masterProbeStart, probePeriod)) {
+    t = nextMaster(true);
+    tokenProbe = true;
+  }
+  if (t == busMasterId) {
+    // ostatni mastery jsou mrtvi
+    acquireToken();
+    return;
+  }
+  tokenTries = 0;
+  sendToken(t);
+}
+
+/**
+ * Naslednik nezacal vysilat: opakovani, nebo jej preskocit
+ */
+void tokenPassFailed() {
+  if (!tokenProbe && (++tokenTries < tokenPassRepeats)) {
+    sendToken(tokenTarget);
+    return;
+  }
+  if (!tokenProbe) {
+    if (printErrors) {
+      Serial.print(F("Master down: ")); Serial.println(tokenTarget);
+    }
+    mastersDown |= (1U << tokenTarget);
+    recordStartTime(masterProbeStart);
+  }
+  passToken();
+}
+
+/**
+ * Prijat packet od jineho masteru: bud predava pesek nam, nebo pesek ma (a pak jej nemame my).
+ */
+void masterFrameHeard(const CommFrame& f) {
+  byte m = f.from;
+  if (mastersDown & (1U << m)) {
+    if (printErrors) {
+      Serial.print(F("Master up: ")); Serial.println(m);
+    }
+    mastersDown &= ~(1U << m);
+  }
+  if ((f.to == busMasterId) && (f.len == 1) && (f.dataStart == opToken)) {
+    acquireToken();
+    return;
+  }
+  if ((tokenState == tokenHeld) && printErrors) {
+    Serial.print(F("Token collision: ")); Serial.println(m);
+  }
+  tokenState = tokenNone;
+}
+
+/**
+ * Smi master zahajit packet ? Hlida predani pesku a jeho ztratu.
+ */
+boolean holdsToken() {
+  if (!isMultiMaster()) {
+    return true;
+  }
+  if (tokenState == tokenPassed) {
+    unsigned int s = tokenPassStart;
+    if (elapsedTime(s, tokenPassTimeout)) {
+      tokenPassFailed();
+    }
+    return false;
+  }
+  if (tokenState == tokenNone) {
+    unsigned int s = busActivityTime;
+    if (elapsedTime(s, tokenLostTime + busMasterId * tokenClaimSlot)) {
+      if (printErrors) {
+        Serial.println(F("Token regenerated"));
+      }
+      tokenClaims++;
+      acquireToken();
+    }
+  }
+  return tokenState == tokenHeld;
+}
+
+/**
+ * Master nema co vysilat; po `tokenIdleTime` preda pesek.
+ */
+void passTokenIfIdle() {
+  if (!isMultiMaster() || (tokenState != tokenHeld)) {
+    return;
+  }
+  unsigned int s = tokenUseTime;
+  if (elapsedTime(s, tokenIdleTime)) {
+    passToken();
+  }
+}
+
 void printPacket(const CommFrame& f) {
   Serial.print(F("f:")); Serial.print(f.from); Serial.print(F("t:")); Serial.print(f.to);
   Serial.print(F(" l:")); Serial.print(f.len); 
@@ -191,11 +795,6 @@ boolean masterReceiving = false;
  */
 volatile byte recvError = 0;
 
-/**
- * The message received from ISR
- */
-volatile const CommFrame* receivedMessage = NULL;
-
 
 /**
  * Starts receiving bytes.
@@ -216,29 +815,37 @@ void masterStartReceiver() {
 void masterStopReceiver() {
   masterReceiving = false;
   recvError = 0;
-  stopReceiver();
+  if (isAwaitingStart()) {
+    // rozpracovany ramec (napr. ACK dalsiho clena skupiny) se dokonci do slotu
+    stopReceiver();
+  }
   startReceiverTime = 0;
 }
 
 void transmitFrames() {
+  if (isBusMonitor()) {
+    processBusMonitor();
+    return;
+  }
   periodicReceiveCheck();
-  if (isReceiving()) {
-    if (startReceiverTime > 0 && elapsedTime(startReceiverTime, ackTimeout)) {
+  if (isReceiving() && (receivedFrame() == NULL)) {
+    if (masterReceiving && !isGroup(xmitTarget) && isAwaitingStart() && ((micros() - xmitEndMicros) > slaveAckTimeout(xmitTarget))) {
       if (debugBusMaster) {
-        Serial.print(F("Timeout @start "));  Serial.print(startReceiverTime, HEX); Serial.print('-'); Serial.println(millis(), HEX);
+        Serial.print(F("Timeout @start "));  Serial.print(xmitTarget); Serial.print('-'); Serial.println(micros() - xmitEndMicros);
       }
-      /*
-      boolean r = masterReceiving;
       masterStopReceiver();
-      if (r) {
-        scheduleRepeat();
-      }
-      */
+      linkFailed(xmitTarget, true);
+      scheduleRepeat();
     }
     // we are listening now.
     return;
   }
   readReceivedMessage();
+  if (isReceiving()) {
+    // cekame na ACK dalsich clenu skupiny
+    return;
+  }
+  probeDownSlaves();
   boolean cont = false;
   do {
     cont = false;
@@ -246,7 +853,8 @@ void transmitFrames() {
       long lastTransmit = millis();
       // when transmitSingle returns true, the receiver is already activated
       // but bus master need to set up the variables ASAP, before this function ends.
-      while (!transmitSingle(true)) {
+      boolean expectAck = !tokenXmit && !isBroadcast(xmitTarget);
+      while (!transmitSingle(expectAck)) {
         // transmit at most 5ms
         long l = millis();
         int d = l - lastTransmit;
@@ -261,19 +869,52 @@ void transmitFrames() {
         Serial.println(F("Complete -> listen"));
       }
       printBufStat();
+      if (tokenXmit) {
+        tokenXmit = false;
+        recordStartTime(tokenPassStart);
+        return;
+      }
+      xmitEndMicros = micros();
+      if (!expectAck) {
+        discardPacket();
+        return;
+      }
       // switch to listening
       masterStartReceiver();
+      if (isGroup(xmitTarget)) {
+        recordStartTime(groupAckStart);
+        groupAckWindow = recvDelayStartByte;
+        for (unsigned int m = groupPending; m; m &= m - 1) {
+          groupAckWindow += groupAckSlot;
+        }
+      }
+      return;
+    }
+    if (!holdsToken()) {
+      return;
+    }
+    unsigned int hs = tokenHoldStart;
+    if (isMultiMaster() && elapsedTime(hs, tokenHoldTime)) {
+      passToken();
       return;
     }
     
-    if (sendPacket == NULL || sendPacket >= msgBufferTop) {
+    if (sendPacket == NULL || (byte*)sendPacket >= msgBufferTop) {
       checkAndRepeatFailed();
       if (sendPacket == NULL) {
+        pollFeedback();
+      }
+      if (sendPacket == NULL) {
+        passTokenIfIdle();
         return;
       }
       // fall through to send
     }
-    while (sendPacket < msgBufferTop) {
+    while ((byte*)sendPacket < msgBufferTop) {
+      selectPacket();
+      if ((byte*)sendPacket >= msgBufferTop) {
+        break;
+      }
       // normal data to transmit; check if the data targets a blocked client
       if (debugBusMaster) {
         Serial.println(F("Got packet: "));
@@ -281,7 +922,20 @@ void transmitFrames() {
         Serial.println();
       }
       byte t = sendPacket->to;
-      if (readBit(blockedSlaves, t)) {
+      if (isSlaveDown(t) && !isProbe(*sendPacket)) {
+        if (sendPacket->priority >= prioUrgent) {
+          if (!sendPacket->hasDeadline) {
+            // odlozeny packet bez lhuty by frontu drzel, dokud se slave neozve
+            setDeadline(*sendPacket, maxDeadline);
+          }
+          skipPacket();
+        } else {
+          if (printErrors) {
+            Serial.print(F("Slave down, drop: ")); sendPacket->printStat(); Serial.println();
+          }
+          discardPacket();
+        }
+      } else if ((t < maxAddress) && readBit(blockedSlaves, t)) {
         if (debugBusMaster) {
           Serial.println(F("Slave blocked"));
         }
@@ -299,7 +953,25 @@ void transmitFrames() {
         printBufStat();
         // we have something to transmit
         xmitTarget = t;
-        transmitFrame(sendPacket);
+        recordStartTime(tokenUseTime);
+        if (t < maxSlaves) {
+          slaveLinks[t].frames++;
+          if (sendPacket->retryCount > 0) {
+            slaveLinks[t].retries++;
+          }
+        }
+        if (isGroup(t)) {
+          groupPending = groupMembers(*sendPacket) & ~slavesDown;
+          if (groupPending == 0) {
+            discardPacket();
+            continue;
+          }
+          // mrtvi clenove nedostanou slot pro ACK
+          byte* d = &sendPacket->dataStart;
+          d[0] = groupPending & 0xff;
+          d[1] = groupPending >> 8;
+        }
+        transmitFrame(sendPacket, foldsLength(*sendPacket));
         cont = true;
         break;
       }
@@ -311,11 +983,12 @@ void transmitFrames() {
   // reached end, buffer is compacted
   msgBufferTop = msgBufferHead;
   sendPacket = NULL;
+  passTokenIfIdle();
 }
 
 void discardPacket() {
   if (debugBusMaster) {
-    Serial.print(F("Drop packet: ")); Serial.println((int)sendPacket, HEX);
+    Serial.print(F("Drop packet: ")); Serial.println((uintptr_t)sendPacket, HEX);
   }
   if (sendPacket == NULL) {
     return;
@@ -328,7 +1001,12 @@ void discardPacket() {
 
 void scheduleRepeat() {
   byte t = sendPacket->to;
-  if (t != addressBroadcast && t < maxSlaves) {
+  if (t < maxAddress) {
+    if (isSlaveDown(t)) {
+      // zkusebni packet se neopakuje
+      discardPacket();
+      return;
+    }
     if (sendPacket->retryCount++ >= maxPacketRepeats) {
       if (printErrors) {
         Serial.print(F("Retry failed: ")); 
@@ -336,6 +1014,14 @@ void scheduleRepeat() {
         Serial.println();
       }
       writeBit(failedSlaves, t, 1);
+      markSlaveDown(t);
+      if (isGroup(t)) {
+        for (byte a = 0; a < maxSlaves; a++) {
+          if (groupPending & (1U << a)) {
+            markSlaveDown(a);
+          }
+        }
+      }
       discardPacket();
       return;
     }
@@ -348,29 +1034,44 @@ void scheduleRepeat() {
 }
 
 /**
- * Reception of the message
+ * Je `f` ACK posledniho packetu? Za checksumem muze byt stav slave.
  */
-void onReceivedMessage(const CommFrame& frame) {
-  receivedMessage = &frame;
+boolean isAckFrame(const CommFrame& f) {
+  return (f.len >= checksumSize) && (f.len <= checksumSize + maxAckStatus) && (f.dataStart == xmitXor);
 }
 
 void readReceivedMessage() {
   boolean r = masterReceiving;
+  const CommFrame* received = receivedFrame();
+  // packety ostatnich masteru ridi pesek; ostatni, kdyz se na nic neceka, nejsou zajimave
+  while ((received != NULL) && (!r || isMasterFrame(*received))) {
+    if (isMasterFrame(*received)) {
+      masterFrameHeard(*received);
+    }
+    releaseReceivedFrame();
+    received = receivedFrame();
+  }
   if (!r) {
     // neni zajimave, low-level prijimac vyhlasil chybu
     // kdyz se po nem nic nechtelo. Mozna by to ale chtelo
     // pockat s vysilanim, kdyz je "na drate" binec ?
     return;
   }
-  if (recvError > 0) {
+  if ((recvError > 0) && (received == NULL)) {
     if (debugBusMaster) {
       Serial.println(F("Error flag is set")); 
     }
+    byte err = recvError;
     masterStopReceiver();
+    if (isGroup(xmitTarget)) {
+      continueGroupAck();
+      return;
+    }
+    linkFailed(xmitTarget, err == errTimeoutStart);
     scheduleRepeat();
     return;
   }
-  if (receivedMessage == NULL) {
+  if (received == NULL) {
     // jeste zadna zprava nedorazila, jedeme dal...
     return;
   }
@@ -378,22 +1079,35 @@ void readReceivedMessage() {
     Serial.println(F("Received message")); 
   }
   masterStopReceiver();
-  if (!r) {
-    Serial.println(F("Unexpected: discard")); 
+  // ramec se jen precte, slot se muze hned vratit; dalsi ramce zustanou ve slotech
+  CommFrame frame = *received;
+  byte status[maxAckStatus];
+  byte statusLen = 0;
+  if (isAckFrame(frame)) {
+    statusLen = frame.len - checksumSize;
+    memcpy(status, received->data() + checksumSize, statusLen);
+  }
+  releaseReceivedFrame();
+  if (isGroup(xmitTarget)) {
+    if ((frame.len == sizeof(checksum_t)) && (frame.from < maxSlaves) && (frame.dataStart == xmitXor)) {
+      groupPending &= ~(1U << frame.from);
+      linkAck(frame.from, 0);
+    }
+    continueGroupAck();
     return;
   }
-  const volatile CommFrame& frame = *receivedMessage;
-  receivedMessage = NULL;
-  startReceiverTime = 0;
-  if ((frame.len != sizeof(checksum_t)) || (frame.from != xmitTarget) || (frame.dataStart != xmitXor)) {
+  if (!isAckFrame(frame) || (frame.from != xmitTarget)) {
     // checksum OK, but bad data
     if (debugBusMaster) {
       frame.printStat();
       Serial.print(F("Bad ACK: ")); Serial.print(xmitXor, HEX); Serial.print(':'); Serial.print(frame.dataStart, HEX); 
       Serial.print(" f:"); Serial.print(frame.from); Serial.print(':'); Serial.println(xmitTarget);
     }
+    linkFailed(xmitTarget, false);
     scheduleRepeat();
   } else {
+    linkAck(xmitTarget, (sendPacket->retryCount == 0) ? (micros() - xmitEndMicros) : 0);
+    applyAckStatus(xmitTarget, status, statusLen);
     discardPacket();
     if (debugBusMaster) {
       Serial.println(F("Got ACK"));
@@ -402,24 +1116,213 @@ void readReceivedMessage() {
   }
 }
 
+byte deadlineNow() {
+  return (currentMillis / deadlineTick) & 0xff;
+}
+
+void setDeadline(CommFrame& f, unsigned int deadline) {
+  f.hasDeadline = (deadline > 0);
+  f.deadline = deadlineNow() + (min(deadline, maxDeadline) + deadlineTick - 1) / deadlineTick;
+}
+
+boolean isExpired(const CommFrame& f) {
+  return f.hasDeadline && ((signed char)(deadlineNow() - f.deadline) > 0);
+}
+
+/**
+ * Data packetu bez hlavicky skupiny
+ */
+byte* framePayload(CommFrame& f) {
+  return &f.dataStart + (isGroup(f.to) ? groupHeaderSize : 0);
+}
+
+/**
+ * Vyjme packet z fronty, nasledujici packety posune.
+ */
+void removePacket(CommFrame* f) {
+  byte* n = (byte*)f->next();
+  memmove(f, n, msgBufferTop - n);
+  msgBufferTop -= (n - (byte*)f);
+}
+
+void reverseBytes(byte* from, byte* to) {
+  while (from < --to) {
+    byte x = *from;
+    *(from++) = *to;
+    *to = x;
+  }
+}
+
+/**
+ * Vybere z dosud nezpracovanych packetu ten s nejvyssi prioritou a presune jej na misto `sendPacket`,
+ * ostatni packety si zachovaji poradi. Packety s proslou lhutou z fronty vyradi.
+ */
+void selectPacket() {
+  CommFrame* best = NULL;
+  CommFrame* f = sendPacket;
+  while ((byte*)f < msgBufferTop) {
+    if (isExpired(*f)) {
+      if (printErrors) {
+        Serial.print(F("Expired: ")); f->printStat();
+      }
+      removePacket(f);
+      continue;
+    }
+    if ((best == NULL) || (f->priority > best->priority)) {
+      best = f;
+      if (best->priority == prioUrgent) {
+        break;
+      }
+    }
+    f = f->next();
+  }
+  if ((best == NULL) || (best == sendPacket)) {
+    return;
+  }
+  if (debugBusMaster) {
+    Serial.print(F("Priority packet ")); best->printStat();
+  }
+  // rotace [sendPacket, best, best->next) => [best, sendPacket, ...]
+  byte* first = (byte*)sendPacket;
+  byte* mid = (byte*)best;
+  byte* last = (byte*)best->next();
+  reverseBytes(first, mid);
+  reverseBytes(mid, last);
+  reverseBytes(first, last);
+}
+
+/**
+ * Je packet prave vysilan, nebo se ceka na jeho ACK ?
+ */
+boolean isInFlight(const CommFrame* f) {
+  return (f == sendPacket) && (isTransmitting() || masterReceiving);
+}
+
+/**
+ * Najde ve fronte neodeslany packet se stejnym cilem a prikazem a nahradi jeho data.
+ */
+boolean supersedePacket(const byte target, const byte* msg, byte len, byte priority, unsigned int deadline) {
+  // nejdrive odlozene packety, pak dosud nezpracovane
+  CommFrame* f = (CommFrame*)msgBuffer;
+  const byte* end = msgBufferHead;
+  // kompaktni prikaz: [operace] [stav << 7 | prikaz]
+  byte cmdMask = ((len == 2) && (msg[0] == opKeyCommand)) ? 0x7f : 0xff;
+  for (byte pass = 0; pass < 2; pass++) {
+    for (; (byte*)f < end; f = f->next()) {
+      byte* d = framePayload(*f);
+      if (!f->supersede || (f->to != target) || ((d + len) != (byte*)f->next()) || (d[0] != msg[0]) || ((d[1] ^ msg[1]) & cmdMask) || isInFlight(f)) {
+        continue;
+      }
+      memcpy(d, msg, len);
+      if (isGroup(target)) {
+        unsigned int members = busGroups[target - addressGroupBase];
+        f->dataStart = members & 0xff;
+        *(&f->dataStart + 1) = members >> 8;
+      }
+      f->retryCount = 0;
+      f->priority = priority;
+      setDeadline(*f, deadline);
+      if (debugBusMaster) {
+        Serial.print(F("Superseded ")); f->printStat();
+      }
+      return true;
+    }
+    if (sendPacket == NULL) {
+      break;
+    }
+    f = sendPacket;
+    end = msgBufferTop;
+  }
+  return false;
+}
+
+/**
+ * Uvolni ve fronte misto pro `size` byte vyrazenim nejmladsich packetu s prioritou nizsi nez `priority`.
+ */
+boolean dropLowerPriority(byte priority, byte size) {
+  while ((msgBufferTop + size) >= msgBufferLimit) {
+    if (sendPacket == NULL) {
+      return false;
+    }
+    CommFrame* victim = NULL;
+    for (CommFrame* f = sendPacket; (byte*)f < msgBufferTop; f = f->next()) {
+      if ((f->priority < priority) && !isInFlight(f) && ((victim == NULL) || (f->priority <= victim->priority))) {
+        victim = f;
+      }
+    }
+    if (victim == NULL) {
+      return false;
+    }
+    if (printErrors) {
+      Serial.print(F("Dropped for priority: ")); victim->printStat();
+    }
+    removePacket(victim);
+  }
+  return true;
+}
+
+/**
+ * Maska clenu skupiny ulozena na zacatku dat packetu
+ */
+unsigned int groupMembers(const CommFrame& f) {
+  const byte* d = f.data();
+  return d[0] | (d[1] << 8);
+}
+
+/**
+ * Smi se cili packetu poslat slozeny byte delky?
+ */
+boolean foldsLength(const CommFrame& f) {
+  unsigned int m = isGroup(f.to) ? groupMembers(f) : ((f.to < maxSlaves) ? (1U << f.to) : 0);
+  return (m != 0) && ((m & ~foldSlaves) == 0);
+}
+
+/**
+ * Po prijmu (nebo chybe) ACK od clena skupiny: bud se ceka na dalsi sloty, nebo je packet
+ * dorucen, nebo se zopakuje pro cleny, kteri neodpovedeli.
+ */
+void continueGroupAck() {
+  unsigned int s = groupAckStart;
+  if (groupPending == 0) {
+    discardPacket();
+    return;
+  }
+  if (!elapsedTime(s, groupAckWindow)) {
+    masterStartReceiver();
+    return;
+  }
+  if (debugBusMaster) {
+    Serial.print(F("Group not ACKed: ")); Serial.println(groupPending, HEX);
+  }
+  for (byte a = 0; a < maxSlaves; a++) {
+    if (groupPending & (1U << a)) {
+      linkFailed(a, true);
+    }
+  }
+  byte* d = &sendPacket->dataStart;
+  d[0] = groupPending & 0xff;
+  d[1] = groupPending >> 8;
+  scheduleRepeat();
+}
+
 void printOutputBuffer() {
   if (!debugBusMaster) {
     return;
   }
   const CommFrame* pF = (CommFrame*)msgBuffer;
   Serial.println(F("Dumping buffer"));
-  while (pF < msgBufferTop) {
+  while ((const byte*)pF < msgBufferTop) {
     byte l = pF->len;
     if ((void*)pF == msgBufferHead) {
       Serial.print('*');
     }
-    Serial.print('@'); Serial.print((int)pF, HEX); Serial.print('\t');
+    Serial.print('@'); Serial.print((uintptr_t)pF, HEX); Serial.print('\t');
     Serial.print(F("From:")); Serial.print(pF->from); 
     Serial.print(F(" To:")); Serial.print(pF->to);
     Serial.print(F(" Len:")); Serial.print(l);
     Serial.print(F(" Retr:")); Serial.print(pF->retryCount); 
     Serial.print(' ');
-    byte *d = &(pF->dataStart);
+    const byte *d = &(pF->dataStart);
     Serial.print(*d++, HEX);
     if (l-- > 1) {
       Serial.print(' '); Serial.print(*d++, HEX);
@@ -435,64 +1338,110 @@ void printOutputBuffer() {
 }
 
 void compactBuffer() {
-  if (sendPacket <= msgBufferHead) {
+  if ((byte*)sendPacket <= msgBufferHead) {
     return;
   }
   int shiftBytes = ((byte*)sendPacket) - ((byte*)msgBufferHead);
   int len = msgBufferTop - ((byte*)sendPacket);
   if (len > 0) {
     if (debugBusMaster) {
-      Serial.print("Compacting: "); Serial.print((int)sendPacket, HEX); Serial.print(':'); Serial.print(len); Serial.print('-'); Serial.print((int)msgBufferHead, HEX);
-      Serial.print(" start:"); Serial.println((int)msgBuffer, HEX);
+      Serial.print("Compacting: "); Serial.print((uintptr_t)sendPacket, HEX); Serial.print(':'); Serial.print(len); Serial.print('-'); Serial.print((uintptr_t)msgBufferHead, HEX);
+      Serial.print(" start:"); Serial.println((uintptr_t)msgBuffer, HEX);
     }
     memmove(msgBufferHead, sendPacket, len);
   }
   sendPacket = (CommFrame*)msgBufferHead;
   msgBufferTop -= shiftBytes;
-  if (msgBufferTop <= sendPacket) {
+  if (msgBufferTop <= (byte*)sendPacket) {
     sendPacket = NULL;
   }
   if (debugBusMaster) {
-    Serial.print("Buf: "); Serial.print((int)msgBuffer, HEX); Serial.print(" head:"); Serial.print((int)msgBufferHead, HEX); 
-    Serial.print(" send:"); Serial.print((int)sendPacket, HEX); Serial.print(" top:"); Serial.print((int)msgBufferTop, HEX);
-    Serial.print(" lim:"); Serial.println((int)msgBufferLimit, HEX);
+    Serial.print("Buf: "); Serial.print((uintptr_t)msgBuffer, HEX); Serial.print(" head:"); Serial.print((uintptr_t)msgBufferHead, HEX); 
+    Serial.print(" send:"); Serial.print((uintptr_t)sendPacket, HEX); Serial.print(" top:"); Serial.print((uintptr_t)msgBufferTop, HEX);
+    Serial.print(" lim:"); Serial.println((uintptr_t)msgBufferLimit, HEX);
   }
 }
 
 /**
- *  Queues the message for sending
+ * Free bytes in the queue, including space reclaimed by compactBuffer(). A message takes CommFrame::skipSize(len) + 1 bytes.
+ */
+unsigned int messageQueueFree() {
+  unsigned int reclaim = (sendPacket != NULL) ? ((byte*)sendPacket - msgBufferHead) : 0;
+  return (msgBufferLimit - msgBufferTop) + reclaim;
+}
+
+/**
+ *  Queues the message for sending; false, if the message was not queued
+ */
+boolean addMessage(const byte target, const byte sender, const byte* msg, byte len) {
+  return addMessage(target, sender, msg, len, prioNormal, 0, false);
+}
+
+/**
+ * Queues the message with the priority class (BusPriority) and deadline in ms (0 = none). If `supersede` is set, the message 
+ * replaces a queued, not yet sent message for the same target with the same first two bytes of data. Returns false, if the message
+ * was not queued (full buffer, bad target).
  */
-void addMessage(const byte target, const byte sender, const byte* msg, byte len) {
+boolean addMessage(const byte target, const byte sender, const byte* msg, byte len, byte priority, unsigned int deadline, boolean supersede) {
+  if (isBusMonitor()) {
+    // analyzator nevysila
+    return false;
+  }
+  if (CommFrame::frameSize(len + (isGroup(target) ? groupHeaderSize : 0)) > recvBufferSize) {
+    // slave by ramec neprijal; delka nad lenFoldMask by se na drate cetla jako slozena
+    Serial.println(F("Message too long"));
+    return false;
+  }
+  if (supersede && (len >= 2) && supersedePacket(target, msg, len, priority, deadline)) {
+    return true;
+  }
+  unsigned int members = 0;
+  if (isGroup(target)) {
+    members = busGroups[target - addressGroupBase];
+    if (members == 0) {
+      return false;
+    }
+    len += groupHeaderSize;
+  }
   byte tlen = CommFrame::skipSize(len) + 1;
   if (debugBusMaster) {
     Serial.print("Adding msg: "); Serial.print("t :"); Serial.print(target); Serial.print(" s:"); Serial.print(sender);
-    Serial.print(" data @"); Serial.print((int)msg, HEX); Serial.print(" l:"); Serial.println(len);
+    Serial.print(" data @"); Serial.print((uintptr_t)msg, HEX); Serial.print(" l:"); Serial.println(len);
     Serial.print("Framelen: "); Serial.println(tlen);
   }
-  if (!isBroadcast(sender) && target >= maxSlaves) {
-    return;
+  if (!isBroadcast(target) && !isGroup(target) && target >= maxSlaves) {
+    return false;
   }
   if (sender>= maxSlaves) {
-    return;
+    return false;
   }
   if ((msgBufferTop + tlen) >= msgBufferLimit) {
     if (debugBusMaster) {
       Serial.println("Buffer full, compacting");
     }
     compactBuffer();
-    if ((msgBufferTop + tlen) >= msgBufferLimit) {
+    if (!dropLowerPriority(priority, tlen)) {
       // FIXME: should probably somehow alert
       Serial.println("Transmit buffer full");
-      return;
+      return false;
     }
   }
 
   CommFrame& frame = *((CommFrame*)msgBufferTop);
   frame.retryCount = 0;
+  frame.priority = priority;
+  frame.supersede = supersede;
+  setDeadline(frame, deadline);
   frame.from = sender;
   frame.to = target;
   frame.len = len;
-  memmove(&frame.dataStart, msg, len);
+  byte* d = &frame.dataStart;
+  if (members != 0) {
+    *(d++) = members & 0xff;
+    *(d++) = members >> 8;
+    len -= groupHeaderSize;
+  }
+  memmove(d, msg, len);
   if (debugBusMaster) {
     Serial.print(F("485-addMsg ")); frame.printStat();
   }
@@ -504,14 +1453,257 @@ void addMessage(const byte target, const byte sender, const byte* msg, byte len)
     sendPacket = &frame;
   }
   if (debugBusMaster) {
-    Serial.print("New frame @"); Serial.println((int)&frame, HEX);
+    Serial.print("New frame @"); Serial.println((uintptr_t)&frame, HEX);
     frame.printStat();
-    Serial.print(" next @"); Serial.print((int)msgBufferTop, HEX); Serial.println();
+    Serial.print(" next @"); Serial.print((uintptr_t)msgBufferTop, HEX); Serial.println();
     printBufStat();
   }
+  return true;
 }
 
 void onReceiveError(int reason) {
   recvError = reason;
+  monitorReceiveError(reason);
+}
+
+void dumpBusGroups() {
+  for (byte g = 0; g < maxBusGroups; g++) {
+    unsigned int m = busGroups[g];
+    if (m == 0) {
+      continue;
+    }
+    Serial.print(F("GRP:")); Serial.print(g + 1);
+    for (byte a = 0; a < maxSlaves; a++) {
+      if (m & (1U << a)) {
+        Serial.print(':'); Serial.print(a);
+      }
+    }
+    Serial.println();
+  }
+}
+
+/**
+ * GRP:skupina:adresa:adresa... definuje cleny skupiny; GRP:skupina zrusi skupinu. Skupina 1 ma na sbernici
+ * adresu `addressGroupBase`, skupina 2 `addressGroupBase` + 1 atd.
+ */
+void commandBusGroup() {
+  int g = nextNumber();
+  if (g == -2) {
+    dumpBusGroups();
+    return;
+  }
+  if ((g < 1) || (g > maxBusGroups)) {
+    Serial.println(F("Bad group"));
+    return;
+  }
+  unsigned int m = 0;
+  int a;
+  while ((a = nextNumber()) != -2) {
+    if ((a < 1) || (a >= maxSlaves) || (a == busMasterId) || (busMasters & (1U << a))) {
+      Serial.println(F("Bad addr"));
+      return;
+    }
+    m |= (1U << a);
+  }
+  busGroups[g - 1] = m;
+  Serial.print(F("Group ")); Serial.print(g); Serial.print(F(" addr ")); Serial.println(addressGroupBase + g - 1);
+}
+
+void dumpBusStats() {
+  for (byte t = 0; t < maxSlaves; t++) {
+    const SlaveLink& l = slaveLinks[t];
+    if (l.frames == 0) {
+      continue;
+    }
+    Serial.print(F("BUS:")); Serial.print(t); Serial.print(':');
+    Serial.print(l.frames); Serial.print(':'); Serial.print(l.retries); Serial.print(':');
+    Serial.print(l.timeouts); Serial.print(':'); Serial.print(l.errors); Serial.print(':');
+    Serial.print(l.rttMin); Serial.print(':'); Serial.print(l.srtt); Serial.print(':'); Serial.print(l.rttMax); Serial.print(':');
+    Serial.println(slaveAckTimeout(t));
+  }
+  Serial.print(F("BUS:rx:")); Serial.print(readRingOverruns(false)); Serial.print(':'); Serial.println(recvSlotDrops);
+}
+
+/**
+ * BUS vypise statistiku spojeni se slave:
+ *    BUS:adresa:packety:opakovani:timeouty:chyby:min RTT:prumer RTT:max RTT:timeout ACK
+ *    BUS:rx:ztracene byte:zahozene ramce
+ * casy v mikrosekundach. BUS:c statistiku vynuluje (namerene RTT zustava).
+ */
+void commandBusStats() {
+  if (*inputPos == 'c') {
+    for (byte t = 0; t < maxSlaves; t++) {
+      SlaveLink& l = slaveLinks[t];
+      l.frames = l.retries = l.timeouts = l.errors = 0;
+      l.rttMin = l.rttMax = l.srtt;
+    }
+    readRingOverruns(true);
+    recvSlotDrops = 0;
+    Serial.println(F("Cleared"));
+    return;
+  }
+  dumpBusStats();
 }
 
+/**
+ * SLV vypise stav slave, se kterymi master komunikoval: SLV:adresa:stav, stav u = zivy, s = podezrely, d = mrtvy
+ */
+void commandSlaves() {
+  for (byte t = 0; t < maxSlaves; t++) {
+    char c = 'u';
+    if (slavesDown & (1U << t)) {
+      c = 'd';
+    } else if (slavesSuspect & (1U << t)) {
+      c = 's';
+    } else if ((slaveLinks[t].frames == 0) && (slaveLinks[t].srtt == 0)) {
+      continue;
+    }
+    Serial.print(F("SLV:")); Serial.print(t); Serial.print(':'); Serial.println(c);
+  }
+}
+
+void dumpBusMasters() {
+  if (!isMultiMaster()) {
+    Serial.println(F("MST:0"));
+    return;
+  }
+  Serial.print(F("MST"));
+  for (byte a = 0; a < maxSlaves; a++) {
+    if (busMasters & (1U << a)) {
+      Serial.print(':'); Serial.print(a);
+      if (mastersDown & (1U << a)) {
+        Serial.print('d');
+      }
+    }
+  }
+  Serial.println();
+  Serial.print(F("MST:t:")); Serial.print("nhp"[tokenState]); Serial.print(':');
+  Serial.print(tokenPasses); Serial.print(':'); Serial.println(tokenClaims);
+}
+
+/**
+ * MST:adresa:adresa... definuje mastery sdilejici sbernici (vlastni adresa se prida sama), MST:0 = jediny master. MST vypise
+ * mastery (d = mrtvy) a stav pesku:
+ *    MST:t:stav:predani:obnovy     stav n = nema, h = drzi, p = predava
+ */
+void commandBusMasters() {
+  int a = nextNumber();
+  if (a == -2) {
+    dumpBusMasters();
+    return;
+  }
+  unsigned int m = 0;
+  for (; a != -2; a = nextNumber()) {
+    if (a == 0) {
+      continue;
+    }
+    if ((a < 1) || (a >= maxSlaves)) {
+      Serial.println(F("Bad addr"));
+      return;
+    }
+    m |= (1U << a);
+  }
+  for (byte g = 0; g < maxBusGroups; g++) {
+    if (busGroups[g] & m) {
+      Serial.println(F("Master in group"));
+      return;
+    }
+  }
+  busMasters = m ? (m | (1U << busMasterId)) : 0;
+  mastersDown = 0;
+  tokenState = tokenNone;
+  dumpBusMasters();
+}
+
+void dumpFeedback() {
+  Serial.print(F("FBK"));
+  if (feedbackSlaves == 0) {
+    Serial.print(F(":0"));
+  }
+  for (byte a = 0; a < maxSlaves; a++) {
+    if (feedbackSlaves & (1U << a)) {
+      Serial.print(':'); Serial.print(a);
+    }
+  }
+  Serial.println();
+  for (byte t = 0; t < maxSlaves; t++) {
+    byte any = 0;
+    for (byte i = 0; i < feedbackSlaveBytes; i++) {
+      any |= slaveFeedback[t][i];
+    }
+    if ((any == 0) && !(feedbackSlaves & (1U << t))) {
+      continue;
+    }
+    Serial.print(F("FBK:s:")); Serial.print(t); Serial.print(':');
+    for (byte n = 0; n < maxFeedbackBits; n++) {
+      Serial.print(readBit(slaveFeedback[t], n) ? '1' : '0');
+    }
+    Serial.println();
+  }
+  Serial.print(F("FBK:n:")); Serial.print(feedbackChanges); Serial.print(':'); Serial.println(feedbackPolls);
+}
+
+/**
+ * FBK:adresa:adresa... urci slave, kterych se master pta na zpetna hlaseni, kdyz nema co vysilat; FBK:0 = zadne (hlaseni
+ * v ACK na povely se prijimaji vzdy). FBK vypise nastaveni, stav hlaseni a statistiku:
+ *    FBK:s:slave:bity        hlaseni od 1, '1' = aktivni
+ *    FBK:n:zmeny:dotazy
+ */
+void commandFeedback() {
+  int a = nextNumber();
+  if (a == -2) {
+    dumpFeedback();
+    return;
+  }
+  unsigned int m = 0;
+  for (; a != -2; a = nextNumber()) {
+    if (a == 0) {
+      continue;
+    }
+    if ((a < 1) || (a >= maxSlaves) || (a == busMasterId) || (busMasters & (1U << a))) {
+      Serial.println(F("Bad addr"));
+      return;
+    }
+    m |= (1U << a);
+  }
+  feedbackSlaves = m;
+  dumpFeedback();
+}
+
+void dumpFoldSlaves() {
+  Serial.print(F("FOLD"));
+  if (foldSlaves == 0) {
+    Serial.print(F(":0"));
+  }
+  for (byte a = 0; a < maxSlaves; a++) {
+    if (foldSlaves & (1U << a)) {
+      Serial.print(':'); Serial.print(a);
+    }
+  }
+  Serial.println();
+}
+
+/**
+ * FOLD:adresa:adresa... urci slave (i mastery), kterym se posila slozeny byte delky; FOLD:0 = zadne, vsem obycejna delka.
+ * FOLD vypise nastaveni.
+ */
+void commandFoldSlaves() {
+  int a = nextNumber();
+  if (a == -2) {
+    dumpFoldSlaves();
+    return;
+  }
+  unsigned int m = 0;
+  for (; a != -2; a = nextNumber()) {
+    if (a == 0) {
+      continue;
+    }
+    if ((a < 1) || (a >= maxSlaves) || (a == busMasterId)) {
+      Serial.println(F("Bad addr"));
+      return;
+    }
+    m |= (1U << a);
+  }
+  foldSlaves = m;
+  dumpFoldSlaves();
+}
@@ -0,0 +1,196 @@
+/**
+ * Pasivni analyzator sbernice. Po prikazu MON:1 se prestane vysilat (fronta BusMasteru stoji, nove zpravy se zahazuji), transceiver
+ * zustane na prijmu a kazdy ramec, ktery dekoder RS485Frame slozi - i pro jine adresy - se posle po USB (Serial) do PC. Stejne tak
+ * chyby prijmu (`errChecksum`, `errTimeout`, `errUnexpected` ...), krome timeoutu cekani na start byte (to je jen klid na sbernici).
+ * Jednou za `monitorStatsPeriod` ms se posle statistika.
+ *
+ * Zaznamy jsou binarni:
+ *    [monitorSync] [typ] [delka] [data ...] [xor typu, delky a dat]
+ * typ 'F' ramec:       [cas ms, 2 byte] [delka] [cil] [zdroj] [data ...]     (ramec jako CommFrame od `len`, prvni byte dat rozbaleny)
+ * typ 'E' chyba:       [cas ms, 2 byte] [ReceiveError]
+ * typ 'S' statistika:  [cas ms, 4 byte] [perioda ms, 2] [byte na sbernici, 2] [ramce, 2] [chyby podle ReceiveError od errChecksum, po 1]
+ *                      [ztracene byte, 1] [ramce podle zdroje, `maxSlaves` x 1] [ramce podle cile, `maxSlaves` + skupiny + broadcast, po 1]
+ * Vicebytova cisla LSB prvni, pocty v jednom byte se zastavi na 255. Cas ramce je cas jeho dekodovani v hlavni smycce, ne konce na drate;
+ * 16 bitu casu doplni PC podle posledni statistiky. Vypis v citelne podobe dela `tools/BusMonitor`.
+ *
+ * Pri 9600 Bd neprijde vic nez cca 1 byte za ms, zaznam ramce je o 8 byte delsi nez ramec a USB bezi na 115200 Bd - Serial tedy stiha
+ * a nic se neztrati, dokud hlavni smycka vybira kruhovy buffer prijimace (`recvRingSize` byte = 30 ms). Ztracene byte a ramce
+ * statistika ukazuje, takze se pozna, ze zaznam neni uplny.
+ */
+
+const byte monitorSync = 0xa5;
+
+const byte monitorFrame = 'F';
+const byte monitorError = 'E';
+const byte monitorStats = 'S';
+
+const int monitorStatsPeriod = 1000;
+
+/**
+ * Pocet citanych chyb, od `errChecksum`
+ */
+const byte monitorErrorKinds = errOverrun;
+
+/**
+ * Pocet cilu ve statistice: slave, skupiny, broadcast
+ */
+const byte monitorTargets = maxSlaves + maxBusGroups + 1;
+
+const byte monitorStatsSize = 4 + 2 + 2 + 2 + monitorErrorKinds + 1 + maxSlaves + monitorTargets;
+
+static_assert(monitorStatsSize < monitorSync && recvBufferSize + 2 < monitorSync, "Record length must differ from the sync byte");
+
+boolean busMonitor = false;
+
+unsigned int monitorStatsStart;
+unsigned int monitorFrames;
+unsigned int monitorBytes;
+unsigned int monitorLostStart;
+byte monitorErrors[monitorErrorKinds];
+byte monitorFrom[maxSlaves];
+byte monitorTo[monitorTargets];
+
+void setupBusMonitor() {
+  registerLineCommand("MON", &commandBusMonitor);
+}
+
+boolean isBusMonitor() {
+  return busMonitor;
+}
+
+void clearMonitorStats() {
+  monitorFrames = 0;
+  monitorBytes = recvByteCount;
+  monitorLostStart = readRingOverruns(false) + recvSlotDrops;
+  memset(monitorErrors, 0, sizeof(monitorErrors));
+  memset(monitorFrom, 0, sizeof(monitorFrom));
+  memset(monitorTo, 0, sizeof(monitorTo));
+}
+
+void startBusMonitor() {
+  stopTransmitter();
+  masterStopReceiver();
+  while (receivedFrame() != NULL) {
+    releaseReceivedFrame();
+  }
+  startReceiver();
+  clearMonitorStats();
+  recordStartTime(monitorStatsStart);
+  busMonitor = true;
+}
+
+inline void countSaturated(byte& c) {
+  if (c < 0xff) {
+    c++;
+  }
+}
+
+/**
+ * Posle jeden zaznam; `head` (2 byte casu) a `data`
+ */
+void monitorRecord(byte type, const byte* head, byte headLen, const byte* data, byte len) {
+  byte x = type ^ (headLen + len);
+  Serial.write(monitorSync);
+  Serial.write(type);
+  Serial.write(headLen + len);
+  for (byte i = 0; i < headLen; i++) {
+    x ^= head[i];
+  }
+  for (byte i = 0; i < len; i++) {
+    x ^= data[i];
+  }
+  Serial.write(head, headLen);
+  Serial.write(data, len);
+  Serial.write(x);
+}
+
+void monitorReceived(const CommFrame& f) {
+  byte t[2] = { (byte)(currentMillis & 0xff), (byte)((currentMillis >> 8) & 0xff) };
+  monitorRecord(monitorFrame, t, sizeof(t), &f.len, CommFrame::frameSize(f.len));
+  monitorFrames++;
+  if (f.from < maxSlaves) {
+    countSaturated(monitorFrom[f.from]);
+  }
+  if (f.to < maxSlaves) {
+    countSaturated(monitorTo[f.to]);
+  } else if (isGroup(f.to)) {
+    countSaturated(monitorTo[maxSlaves + f.to - addressGroupBase]);
+  } else if (isBroadcast(f.to)) {
+    countSaturated(monitorTo[monitorTargets - 1]);
+  }
+}
+
+/**
+ * Chyba prijmu z `onReceiveError`
+ */
+void monitorReceiveError(int reason) {
+  if (!busMonitor || (reason == errTimeoutStart) || (reason < errChecksum) || (reason > monitorErrorKinds)) {
+    return;
+  }
+  byte t[3] = { (byte)(currentMillis & 0xff), (byte)((currentMillis >> 8) & 0xff), (byte)reason };
+  monitorRecord(monitorError, t, sizeof(t), NULL, 0);
+  countSaturated(monitorErrors[reason - errChecksum]);
+}
+
+void sendMonitorStats(unsigned int period) {
+  byte s[monitorStatsSize];
+  byte* p = s;
+  unsigned long t = currentMillis;
+  unsigned int bytes = recvByteCount - monitorBytes;
+  unsigned int lost = readRingOverruns(false) + recvSlotDrops - monitorLostStart;
+  for (byte i = 0; i < 4; i++, t >>= 8) {
+    *(p++) = t & 0xff;
+  }
+  *(p++) = period & 0xff;
+  *(p++) = period >> 8;
+  *(p++) = bytes & 0xff;
+  *(p++) = bytes >> 8;
+  *(p++) = monitorFrames & 0xff;
+  *(p++) = monitorFrames >> 8;
+  memcpy(p, monitorErrors, sizeof(monitorErrors));
+  p += sizeof(monitorErrors);
+  *(p++) = min(lost, 0xff);
+  memcpy(p, monitorFrom, sizeof(monitorFrom));
+  p += sizeof(monitorFrom);
+  memcpy(p, monitorTo, sizeof(monitorTo));
+  monitorRecord(monitorStats, NULL, 0, s, sizeof(s));
+  clearMonitorStats();
+}
+
+/**
+ * Misto `transmitFrames` v rezimu analyzatoru: vybere prijate ramce a posle je do PC.
+ */
+void processBusMonitor() {
+  periodicReceiveCheck();
+  const CommFrame* f;
+  while ((f = receivedFrame()) != NULL) {
+    monitorReceived(*f);
+    releaseReceivedFrame();
+  }
+  unsigned int s = monitorStatsStart;
+  if (elapsedTime(monitorStatsStart, monitorStatsPeriod)) {
+    sendMonitorStats(currentMillisLow - s);
+  }
+}
+
+/**
+ * MON:1 zapne analyzator, MON:0 vypne (master pak pokracuje ve vysilani fronty). MON vypise stav.
+ */
+void commandBusMonitor() {
+  int n = nextNumber();
+  switch (n) {
+    case -2:
+      Serial.print(F("MON:")); Serial.println(busMonitor ? 1 : 0);
+      return;
+    case 0:
+      busMonitor = false;
+      stopReceiver();
+      break;
+    case 1:
+      startBusMonitor();
+      break;
+    default:
+      Serial.println(F("Bad mode"));
+      return;
+  }
+}
@@ -9,7 +9,12 @@ const int ioRowSwitchDelay = 0;
 const int keyboardDebounceTime = 20;
 const int maxContinuousTransfer = 30;
 
-const byte s88ModuleCount = 1;
+/**
+ * Kapacita: nejvyse modulu S88 po 8 senzorech, celkem ve vsech retezcich (`s88MaxChains`). Kolik se jich skutecne cte,
+ * urcuje EEData (prikaz S88C), vychozi je `s88DefaultModules` v prvnim retezci.
+ */
+const byte s88ModuleCount = 6;
+const byte s88DefaultModules = 1;
 
 /**
  * Velikost prijmoveho bufferu v byte. Musi byt delsi nez nejdelsi zpracovavany packet.
@@ -48,6 +53,15 @@ const int S88ResetTrack = A2;
  */
 const int S88TrackInput = A7;
 
+/**
+ * Datove vstupy paralelnich retezcu S88; retezce sdileji hodiny, LOAD a RESET. Kolik modulu je v kterem
+ * retezci, urcuje EEData (prikaz S88C), celkem nejvyse `s88ModuleCount`.
+ * Volne digitalni piny jsou jen 12 a 13. Na pin 13 je na desce Nano pripojena LED "L" s rezistorem, ktera vstup zatezuje;
+ * pro treti retezec je treba LED nebo jeji rezistor odpajet, jinak treti retezec nepouzivat.
+ */
+const byte s88MaxChains = 3;
+const int S88Inputs[s88MaxChains] = { S88Input, 12, 13 };
+
 /**
  * Minimum 20ms between S88 debounce tick.
  */
@@ -102,17 +116,44 @@ const byte inputColumns = 8;
 static_assert(inputRows == 8 || inputRows == 16, "Either 8 or 16 rows must be selected");
 
 const byte outputRows = 8;
-const byte outputColumns = 8;
+/**
+ * Pocet zretezenych posuvnych registru (74HC595) pro sloupce vystupni matice; sloupcu je 8x tolik
+ */
+const byte outputShiftRegisters = 1;
+const byte outputColumns = outputShiftRegisters * 8;
 
 const byte maxRowCount = max(inputRows, outputRows);
 const byte maxColumnCount = max(inputColumns, outputColumns);
 
 
 const byte maxKeyTranslations = 32;
+
+/**
+ * Max pocet useku v mapovani senzoru S88 na vystupy
+ */
+const byte maxSensorRanges = 8;
+
+/**
+ * Logicke vyrazy pro odvozene indikace: velikost programu v EEPROM (byte), max pocet vyrazu
+ * a max pocet zavislosti (dvojic vyraz - vstupni byte)
+ */
+const byte logicCodeSize = 96;
+const byte maxLogicExprs = 32;
+const byte maxLogicDeps = 64;
+
+/**
+ * Velikost kruhoveho bufferu zaznamu udalosti (byte); udalost zabere 2-3 byte
+ */
+const byte eventBufferSize = 128;
 const byte outputByteSize = (outputRows * outputColumns + 7) / 8;
 
 const byte maxTarget = 16;
 
+/**
+ * Pocet skupin slave na sbernici (skupinove adresy)
+ */
+const byte maxBusGroups = 4;
+
 const int majorVersion = 0;
 const int minorVersion = 1;
 
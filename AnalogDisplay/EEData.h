@@ -6,18 +6,29 @@
 
 struct EEData {
   KeySpec   keyTranslations[maxKeyTranslations];
-  byte      sensorToOutputMap[outputRows * outputColumns];
+  SensorRange sensorRanges[maxSensorRanges];
+  byte      logicCode[logicCodeSize];
   byte      outputsToFlashOn[outputByteSize];
   byte      busId;
+  unsigned int busGroups[maxBusGroups];
+  unsigned int busMasters;
+  unsigned int feedbackSlaves;
+  unsigned int foldSlaves;
   boolean   flashDefault;
   int       minTrackVoltage;
   int       minTrackPercent;
+  byte      s88Target;
+  byte      s88DeltaDelay;
+  byte      s88SnapshotPeriod;
+  byte      s88ChainModules[s88MaxChains];
   
   byte      enableKeys : 1;
   byte      enableS88 : 1;
   byte      enableTrack : 1;
 
-  EEData() : flashDefault(false), busId(1), minTrackVoltage(40), minTrackPercent(20), enableKeys(1), enableS88(1), enableTrack(1) {}
+  EEData() : flashDefault(false), busId(1), busGroups(), busMasters(0), feedbackSlaves(0), foldSlaves(0), sensorRanges(), logicCode(), minTrackVoltage(40), minTrackPercent(20), s88Target(0), s88DeltaDelay(20), s88SnapshotPeriod(10), s88ChainModules(), enableKeys(1), enableS88(1), enableTrack(1) {
+    s88ChainModules[0] = s88DefaultModules;
+  }
 };
 
 extern EEData eeData;
@@ -26,5 +37,5 @@ const int eeaddr_version = 0;
 const int eeaddr_config = 1;
 const int eeaddr_top = eeaddr_config + sizeof(EEData);
 
-const int CURRENT_DATA_VERSION = 1;
+const int CURRENT_DATA_VERSION = 11;
 
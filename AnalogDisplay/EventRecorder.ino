@@ -0,0 +1,166 @@
+/**
+ * Zaznam udalosti: ustalene zmeny senzoru S88 a klaves se ukladaji do kruhoveho bufferu v RAM, aby slo zpetne zjistit, co se
+ * na kolejisti stalo (napr. kdy a kde "zmizel" vlak). Zaznam je levny (par prirazeni), takze muze bezet stale.
+ *
+ * Format udalosti (2 nebo 3 byte):
+ *    [k << 7 | cislo]  k = 1 klavesa, 0 senzor
+ *    [stav << 7 | ext << 6 | dt & 0x3f]
+ *    [dt >> 6]         jen pokud ext = 1
+ * dt je cas od predchozi udalosti v ms; delsi mezera nez `maxEventDelta` se ulozi jako `maxEventDelta`. Pri zaplneni
+ * se zahazuji nejstarsi udalosti. Presny cas ma jen posledni udalost (`evtLastTime`), casy starsich se pocitaji zpetne od ni;
+ * udalosti pred dlouhou mezerou tak mohou mit cas posunuty.
+ */
+
+const byte evtKeyFlag = 0x80;
+const byte evtStateFlag = 0x80;
+const byte evtExtFlag = 0x40;
+const unsigned int maxEventDelta = 0x3fff;
+
+static_assert(eventBufferSize <= 250, "Event buffer is indexed by byte");
+
+byte evtBuffer[eventBufferSize];
+byte evtHead = 0;      // sem se zapisuje
+byte evtTail = 0;      // nejstarsi udalost
+byte evtUsed = 0;
+
+unsigned long evtLastTime = 0;
+
+void setupEventRecorder() {
+  registerLineCommand("EVT", &commandEvents);
+}
+
+void clearEvents() {
+  evtHead = evtTail = evtUsed = 0;
+}
+
+inline byte evtNext(byte pos) {
+  return (pos + 1 >= eventBufferSize) ? 0 : pos + 1;
+}
+
+inline byte evtSize(byte pos) {
+  return (evtBuffer[evtNext(pos)] & evtExtFlag) ? 3 : 2;
+}
+
+/**
+ * Vrati dt udalosti na pozici `pos`
+ */
+unsigned int evtDelta(byte pos) {
+  pos = evtNext(pos);
+  byte b = evtBuffer[pos];
+  unsigned int dt = b & 0x3f;
+  if (b & evtExtFlag) {
+    dt |= evtBuffer[evtNext(pos)] << 6;
+  }
+  return dt;
+}
+
+inline void evtPut(byte b) {
+  evtBuffer[evtHead] = b;
+  evtHead = evtNext(evtHead);
+}
+
+void recordEvent(byte id, boolean state) {
+  unsigned long dtl = currentMillis - evtLastTime;
+  unsigned int dt = (dtl > maxEventDelta) ? maxEventDelta : dtl;
+  byte sz = (dt > 0x3f) ? 3 : 2;
+
+  evtLastTime = currentMillis;
+  while (evtUsed + sz > eventBufferSize) {
+    byte s = evtSize(evtTail);
+    evtUsed -= s;
+    evtTail = (evtTail + s) % eventBufferSize;
+  }
+  evtUsed += sz;
+  evtPut(id);
+  evtPut((state ? evtStateFlag : 0) | (sz == 3 ? evtExtFlag : 0) | (dt & 0x3f));
+  if (sz == 3) {
+    evtPut(dt >> 6);
+  }
+}
+
+void recordSensorEvent(byte sensor, boolean state) {
+  recordEvent(sensor, state);
+}
+
+void recordKeyEvent(byte key, boolean state) {
+  recordEvent(evtKeyFlag | key, state);
+}
+
+/**
+ * EVT vypise udalosti, EVT:s / EVT:k jen senzory / klavesy, EVT:s:n jen senzor n (od 1). EVT:c smaze zaznam,
+ * EVT:b vypise surova data hexadecimalne (EVB:cas posledni udalosti:byte...).
+ */
+void commandEvents() {
+  char c = *inputPos;
+  int only = -1;
+  byte kind = 0xff;
+  switch (c) {
+    case 'c':
+      clearEvents();
+      Serial.println(F("Events cleared"));
+      return;
+    case 'b':
+      dumpEventsBinary();
+      return;
+    case 's':
+      kind = 0;
+      break;
+    case 'k':
+      kind = evtKeyFlag;
+      break;
+    case 0:
+      break;
+    default:
+      Serial.println(F("Bad filter"));
+      return;
+  }
+  if (c != 0) {
+    inputPos++;
+    if (*inputPos == ':') {
+      inputPos++;
+      only = nextNumber();
+      if (only < 1) {
+        Serial.println(F("Bad number"));
+        return;
+      }
+      only--;
+    }
+  }
+  // cas nejstarsi udalosti: zpetne od posledni
+  unsigned long t = evtLastTime;
+  byte pos = evtTail;
+  for (byte n = 0; n < evtUsed; n += evtSize(pos), pos = (pos + evtSize(pos)) % eventBufferSize) {
+    if (n > 0) {
+      t -= evtDelta(pos);
+    }
+  }
+  pos = evtTail;
+  for (byte n = 0; n < evtUsed; n += evtSize(pos), pos = (pos + evtSize(pos)) % eventBufferSize) {
+    if (n > 0) {
+      t += evtDelta(pos);
+    }
+    byte id = evtBuffer[pos];
+    if ((kind != 0xff) && ((id & evtKeyFlag) != kind)) {
+      continue;
+    }
+    if ((only >= 0) && ((id & ~evtKeyFlag) != only)) {
+      continue;
+    }
+    Serial.print(F("EVT:")); Serial.print(t); Serial.print(':');
+    Serial.print((id & evtKeyFlag) ? 'k' : 's'); Serial.print((id & ~evtKeyFlag) + 1); Serial.print(':');
+    Serial.println((evtBuffer[evtNext(pos)] & evtStateFlag) ? 1 : 0);
+  }
+}
+
+void dumpEventsBinary() {
+  Serial.print(F("EVB:")); Serial.print(evtLastTime); Serial.print(':');
+  byte pos = evtTail;
+  for (byte n = 0; n < evtUsed; n++, pos = evtNext(pos)) {
+    byte b = evtBuffer[pos];
+    if (b < 0x10) {
+      Serial.print('0');
+    }
+    Serial.print(b, HEX);
+  }
+  Serial.println();
+}
@@ -0,0 +1,350 @@
+/**
+ * USB brana pro ridici program v PC. Bezi soubezne s terminalem i s provozem sbernice: zaznam z PC zacina byte `monitorSync`, ktery
+ * se v textu terminalu nevyskytuje, terminal jej preda brane (`gatewayInput`). Ramovani je stejne jako u analyzatoru (BusMonitor.ino):
+ *    [monitorSync] [typ] [delka] [data ...] [xor typu, delky a dat]
+ * Z PC:
+ *    'q' davka zprav:    [poradi] { [cil] [supersede << 7 | priorita << 5 | delka] [data ...] } ...
+ *                        zpravy se zaradi do fronty BusMasteru (`addMessage`), odpovi se 'a'
+ *    'u' odber udalosti: [maska zdroju: bit 0 klavesy, 1 S88, 2 zpetna hlaseni]; nove prihlaseny zdroj posle cely stav
+ *    'b' dotaz na statistiku, odpovi se 'b'
+ * Do PC:
+ *    'a' potvrzeni davky: [poradi] [prijatych zprav] [volno ve fronte, 2 byte]
+ *                        zpravy od prvni neprijate (plna fronta, chybna zprava) posle PC znovu; dalsi davku posila az po 'a'
+ *    'k', 's', 'f' zmeny klaves, S88, zpetnych hlaseni: [cas ms, 2 byte] { [cislo byte] [stav byte] } ...
+ *    'b' statistika:     [cas ms, 4 byte] [volno ve fronte, 2] [slave mimo provoz, 2] [podezreli slave, 2] [ramce, 2] [opakovani, 2]
+ *                        [timeouty, 2] [ztracene prijate byte, 2] [chybne zaznamy z PC, 2]
+ * Vicebytova cisla LSB prvni.
+ *
+ * Brana nikdy neceka na USB: zaznam se posle, jen kdyz se cely vejde do vysilaciho bufferu Serial (`availableForWrite`), jinak az
+ * v nekterem dalsim pruchodu smycky. Udalosti se nefrontuji - zdroj si pamatuje jen zmenene byte (`dirty`) a posila se jejich aktualni
+ * stav; pomaly odber tak prijde o mezistavy, ale ne o konecny stav. Zprava z davky, pro kterou neni misto ve fronte, se odmitne
+ * a nevytlaci jine zpravy.
+ */
+
+const byte gatewayRecBatch = 'q';
+const byte gatewayRecSubscribe = 'u';
+const byte gatewayRecStats = 'b';
+const byte gatewayRecAck = 'a';
+
+/**
+ * Zdroje udalosti; bit v masce odberu
+ */
+const byte gatewayKeys = 0;
+const byte gatewayS88 = 1;
+const byte gatewayFeedback = 2;
+const byte gatewaySources = 3;
+
+const byte gatewaySourceTypes[gatewaySources] = { 'k', 's', 'f' };
+
+/**
+ * Nejdelsi data zaznamu z PC; Serial ma prijimaci buffer 64 byte
+ */
+const byte gatewayRecordSize = 40;
+
+/**
+ * Nejvic zmen v jednom zaznamu udalosti
+ */
+const byte gatewayEventPairs = 8;
+
+/**
+ * Nedokonceny zaznam z PC se zahodi po [ms]
+ */
+const int gatewayRecvTimeout = 50;
+
+/**
+ * Ramovani zaznamu: sync, typ, delka, xor
+ */
+const byte gatewayFraming = 4;
+
+const byte gatewayStatsSize = 4 + 8 * 2;
+
+/**
+ * Bitove pole zmenenych byte pro zdroj s `n` byte stavu
+ */
+#define gatewayDirtyBytes(n) (((n) + 7) / 8)
+
+struct GatewaySource {
+  const byte* state;
+  byte* dirty;
+  byte size;
+  byte next;        // odtud pokracuje dalsi zaznam, aby casto menene nizke byte nezdrzovaly vyssi
+  boolean pending;
+};
+
+GatewaySource gatewaySource[gatewaySources];
+byte gatewaySubscribed;
+
+enum GatewayRecvState {
+  gwIdle = 0,
+  gwType,
+  gwLen,
+  gwData,
+  gwXor
+};
+
+byte feedbackGatewayDirty[gatewayDirtyBytes(sizeof(slaveFeedback))];
+
+byte gatewayRecvState = gwIdle;
+byte gatewayRecvType;
+byte gatewayRecvLen;
+byte gatewayRecvCount;
+byte gatewayRecvXor;
+byte gatewayRecvData[gatewayRecordSize];
+unsigned int gatewayRecvStart;
+
+byte gatewayAckData[4];
+boolean gatewayAckPending;
+boolean gatewayStatsPending;
+
+unsigned int gatewayRecords;
+unsigned int gatewayErrors;
+
+void setupGateway() {
+  registerGatewaySource(gatewayFeedback, &slaveFeedback[0][0], sizeof(slaveFeedback), feedbackGatewayDirty);
+  registerLineCommand("GW", &commandGateway);
+}
+
+/**
+ * Zdroj udalosti `src`: stav `size` byte od `state`; `dirty` je pole `gatewayDirtyBytes(size)` byte
+ */
+void registerGatewaySource(byte src, const byte* state, byte size, byte* dirty) {
+  GatewaySource& s = gatewaySource[src];
+  s.state = state;
+  s.dirty = dirty;
+  s.size = size;
+  s.next = 0;
+  s.pending = false;
+  memset(dirty, 0, gatewayDirtyBytes(size));
+}
+
+/**
+ * Zmenil se byte `n` zdroje `src`; posle se, je-li zdroj odebiran
+ */
+void gatewayChanged(byte src, int n) {
+  GatewaySource& s = gatewaySource[src];
+  if ((gatewaySubscribed & (1 << src)) && (n < s.size)) {
+    writeBit(s.dirty, n, 1);
+    s.pending = true;
+  }
+}
+
+inline boolean gatewayRoom(byte len) {
+  return Serial.availableForWrite() >= len + gatewayFraming;
+}
+
+inline byte* putWord(byte* p, unsigned int v) {
+  *(p++) = v & 0xff;
+  *(p++) = v >> 8;
+  return p;
+}
+
+void gatewaySubscribe(byte mask) {
+  for (byte src = 0; src < gatewaySources; src++) {
+    GatewaySource& s = gatewaySource[src];
+    if (s.state == NULL) {
+      continue;
+    }
+    if (!(mask & (1 << src))) {
+      memset(s.dirty, 0, gatewayDirtyBytes(s.size));
+      s.pending = false;
+    } else if (!(gatewaySubscribed & (1 << src))) {
+      // bity za koncem stavu se neprochazeji
+      memset(s.dirty, 0xff, gatewayDirtyBytes(s.size));
+      s.pending = true;
+    }
+  }
+  gatewaySubscribed = mask;
+}
+
+/**
+ * Zaradi zpravy z davky, dokud jsou spravne a vejdou se do fronty
+ */
+void gatewayQueueBatch(const byte* d, byte len) {
+  if (len < 1) {
+    gatewayErrors++;
+    return;
+  }
+  byte accepted = 0;
+  byte i = 1;
+  while (i + 2 <= len) {
+    byte t = d[i];
+    byte l = d[i + 1] & 0x1f;
+    byte prio = (d[i + 1] >> 5) & 0x03;
+    boolean supersede = (d[i + 1] & 0x80) != 0;
+    byte frameLen = l + (isGroup(t) ? groupHeaderSize : 0);
+    if ((l == 0) || (i + 2 + l > len) || (CommFrame::frameSize(frameLen) > recvBufferSize)) {
+      gatewayErrors++;
+      break;
+    }
+    if (CommFrame::skipSize(frameLen) + 1 >= messageQueueFree()) {
+      break;
+    }
+    if (!addMessage(t, busMasterId, d + i + 2, l, prio, 0, supersede)) {
+      break;
+    }
+    accepted++;
+    i += 2 + l;
+  }
+  unsigned int free = messageQueueFree();
+  gatewayAckData[0] = d[0];
+  gatewayAckData[1] = accepted;
+  putWord(gatewayAckData + 2, free);
+  gatewayAckPending = true;
+}
+
+void gatewayRecord() {
+  gatewayRecords++;
+  switch (gatewayRecvType) {
+    case gatewayRecBatch:
+      gatewayQueueBatch(gatewayRecvData, gatewayRecvLen);
+      break;
+    case gatewayRecSubscribe:
+      gatewaySubscribe((gatewayRecvLen > 0) ? gatewayRecvData[0] : 0);
+      break;
+    case gatewayRecStats:
+      gatewayStatsPending = true;
+      break;
+    default:
+      gatewayErrors++;
+      break;
+  }
+}
+
+/**
+ * Byte z USB, vola terminal. True, pokud patri zaznamu brany.
+ */
+boolean gatewayInput(char c) {
+  byte b = c;
+  unsigned int s = gatewayRecvStart;
+  if ((gatewayRecvState != gwIdle) && elapsedTime(s, gatewayRecvTimeout)) {
+    gatewayErrors++;
+    gatewayRecvState = gwIdle;
+  }
+  switch (gatewayRecvState) {
+    case gwIdle:
+      if (b != monitorSync) {
+        return false;
+      }
+      recordStartTime(gatewayRecvStart);
+      gatewayRecvState = gwType;
+      break;
+    case gwType:
+      gatewayRecvType = gatewayRecvXor = b;
+      gatewayRecvState = gwLen;
+      break;
+    case gwLen:
+      if (b > gatewayRecordSize) {
+        gatewayErrors++;
+        gatewayRecvState = gwIdle;
+        break;
+      }
+      gatewayRecvLen = b;
+      gatewayRecvXor ^= b;
+      gatewayRecvCount = 0;
+      gatewayRecvState = (b > 0) ? gwData : gwXor;
+      break;
+    case gwData:
+      gatewayRecvData[gatewayRecvCount++] = b;
+      gatewayRecvXor ^= b;
+      if (gatewayRecvCount >= gatewayRecvLen) {
+        gatewayRecvState = gwXor;
+      }
+      break;
+    case gwXor:
+      gatewayRecvState = gwIdle;
+      if (b != gatewayRecvXor) {
+        gatewayErrors++;
+        break;
+      }
+      gatewayRecord();
+      break;
+  }
+  return true;
+}
+
+void sendGatewayStats() {
+  byte s[gatewayStatsSize];
+  byte* p = s;
+  unsigned long t = currentMillis;
+  unsigned int frames = 0, retries = 0, timeouts = 0;
+  for (byte i = 0; i < maxSlaves; i++) {
+    frames += slaveLinks[i].frames;
+    retries += slaveLinks[i].retries;
+    timeouts += slaveLinks[i].timeouts;
+  }
+  for (byte i = 0; i < 4; i++, t >>= 8) {
+    *(p++) = t & 0xff;
+  }
+  p = putWord(p, messageQueueFree());
+  p = putWord(p, slavesDown);
+  p = putWord(p, slavesSuspect);
+  p = putWord(p, frames);
+  p = putWord(p, retries);
+  p = putWord(p, timeouts);
+  p = putWord(p, readRingOverruns(false) + recvSlotDrops);
+  putWord(p, gatewayErrors);
+  monitorRecord(gatewayRecStats, NULL, 0, s, sizeof(s));
+}
+
+/**
+ * Posle zmenene byte zdroje, kolik se jich vejde do vysilaciho bufferu; prochazi dokola od byte, kde skoncil predchozi zaznam
+ */
+void sendGatewayEvents(byte src) {
+  GatewaySource& s = gatewaySource[src];
+  int room = Serial.availableForWrite() - gatewayFraming - 2;
+  if (room < 2) {
+    return;
+  }
+  byte pairs = min(room / 2, gatewayEventPairs);
+  byte d[gatewayEventPairs * 2];
+  byte n = 0;
+  byte i = s.next;
+  for (byte k = 0; (k < s.size) && (n < pairs); k++) {
+    if (readBit(s.dirty, i)) {
+      writeBit(s.dirty, i, 0);
+      d[n * 2] = i;
+      d[n * 2 + 1] = s.state[i];
+      n++;
+    }
+    if (++i >= s.size) {
+      i = 0;
+    }
+  }
+  s.next = i;
+  if (n < pairs) {
+    // prosel se cely stav
+    s.pending = false;
+  }
+  if (n == 0) {
+    return;
+  }
+  byte t[2] = { (byte)(currentMillis & 0xff), (byte)((currentMillis >> 8) & 0xff) };
+  monitorRecord(gatewaySourceTypes[src], t, sizeof(t), d, n * 2);
+}
+
+/**
+ * Odesle cekajici odpovedi a udalosti; vola se ze smycky.
+ */
+void processGateway() {
+  if (gatewayAckPending && gatewayRoom(sizeof(gatewayAckData))) {
+    monitorRecord(gatewayRecAck, NULL, 0, gatewayAckData, sizeof(gatewayAckData));
+    gatewayAckPending = false;
+  }
+  if (gatewayStatsPending && gatewayRoom(gatewayStatsSize)) {
+    sendGatewayStats();
+    gatewayStatsPending = false;
+  }
+  for (byte src = 0; src < gatewaySources; src++) {
+    if (gatewaySource[src].pending) {
+      sendGatewayEvents(src);
+    }
+  }
+}
+
+/**
+ * GW vypise stav brany: GW:u:maska odberu, GW:n:prijate zaznamy:chybne zaznamy
+ */
+void commandGateway() {
+  Serial.print(F("GW:u:")); Serial.println(gatewaySubscribed);
+  Serial.print(F("GW:n:")); Serial.print(gatewayRecords); Serial.print(':'); Serial.println(gatewayErrors);
+}
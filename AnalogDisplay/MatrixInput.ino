@@ -9,11 +9,12 @@ KeySpec   (&keyTranslations)[maxKeyTranslations] = eeData.keyTranslations;
 
 // the acknowledged, debounced state
 byte inputDebounced[inputByteSize];
+byte inputGatewayDirty[gatewayDirtyBytes(inputByteSize)];
 
 class KeyDebouncer : public Debouncer {
   public:
   KeyDebouncer(byte modCount, byte* debouncedState);
-  virtual boolean stableChange(byte number, boolean nState);
+  virtual boolean stableChange(int number, boolean nState);
 };
 
 KeyDebouncer::KeyDebouncer(byte modCount, byte* debouncedState) : Debouncer(modCount, debouncedState) {
@@ -29,6 +30,7 @@ void setupInputPorts() {
   pinMode(TcInputData, INPUT);
   pinMode(TcInputLatch, OUTPUT);
   resetInput();
+  registerGatewaySource(gatewayKeys, inputDebounced, inputByteSize, inputGatewayDirty);
 
   registerLineCommand("KMAP", &commandMapKeys);
   registerLineCommand("KEYS", &commandShowKeys);
@@ -79,7 +81,7 @@ void processInputRow() {
   }
 }
 
-int findKeyTranslation(byte nx, byte ny, int& target) {
+int findKeyTranslation(byte nx, byte ny, const KeySpec*& found) {
   for (const KeySpec* spec = keyTranslations; !spec->isEmpty(); spec++) {
     if (spec->matrix) {
       if ((spec->x > nx) || (spec->y > ny)) {
@@ -96,16 +98,18 @@ int findKeyTranslation(byte nx, byte ny, int& target) {
 
     byte r = (ny - spec->y) * fx;
     r += (nx - spec->x);
-    target = spec->target;
+    found = spec;
     return r + spec->commandBase;
   }
   return -1;
 }
 
-boolean KeyDebouncer::stableChange(byte number, boolean nState) {
+boolean KeyDebouncer::stableChange(int number, boolean nState) {
   if (!Debouncer::stableChange(number, nState)) {
     return false;
   }
+  gatewayChanged(gatewayKeys, number >> 3);
+  recordKeyEvent(number, nState);
   byte ny = number / inputColumnsRounded;
   byte nx = number - (ny * inputColumnsRounded);
 
@@ -118,8 +122,8 @@ boolean KeyDebouncer::stableChange(byte number, boolean nState) {
 }
 
 void pressKey(byte nx, byte ny, boolean nState) {
-  int target = 0;
-  int command = findKeyTranslation(nx, ny, target);
+  const KeySpec* spec;
+  int command = findKeyTranslation(nx, ny, spec);
 
   if (command == -1) {
     Serial.print(F("Unhandled key: ")); Serial.print(nx); Serial.print(','); Serial.println(ny);
@@ -127,11 +131,17 @@ void pressKey(byte nx, byte ny, boolean nState) {
   }
   if (debugKeyFn) {
     Serial.print(F("Key ")); Serial.print(nx); Serial.print(','); Serial.print(ny); Serial.print(F(" => "));
-    Serial.print(target); Serial.print(':'); Serial.println(command);
+    Serial.print(spec->target); Serial.print(':'); Serial.println(command);
+  }
+  byte msg[sizeof(RemoteCommand)];
+  byte len = encodeKeyCommand(msg, command, nState);
+  if (len == 0) {
+    Serial.print(F("Command too large: ")); Serial.println(command);
+    return;
   }
-  RemoteCommand cmd(1, command, nState);
 
-  addMessage(target, eeData.busId, (const byte*)&cmd, sizeof(cmd));
+  // prepinac posila stav, novejsi stav nahradi neodeslany starsi
+  addMessage(spec->target, eeData.busId, msg, len, spec->priority, 0, spec->latch);
 }
 
 void commandMapKeys() {
@@ -232,7 +242,7 @@ void commandMapKeys() {
   }
 
   int target = nextNumber();
-  if ((target < 1) || (target == eeData.busId) || (target >= maxTarget)) {
+  if ((target < 1) || (target == eeData.busId) || ((target >= maxTarget) && !isGroup(target))) {
     Serial.println(F("Invalid target"));
     return;
   }
@@ -243,6 +253,21 @@ void commandMapKeys() {
     return;
   }
 
+  int prio = nextNumber();
+  if (prio == -2) {
+    prio = prioNormal;
+  } else if ((prio < prioLow) || (prio > prioUrgent)) {
+    Serial.println(F("Bad priority"));
+    return;
+  }
+  int latch = nextNumber();
+  if (latch == -2) {
+    latch = 0;
+  } else if ((latch < 0) || (latch > 1)) {
+    Serial.println(F("Bad switch flag"));
+    return;
+  }
+
   KeySpec *pos = freeSlot;
   KeySpec spec;
   spec.x = x; spec.y = y;
@@ -250,6 +275,8 @@ void commandMapKeys() {
   spec.lenOrMatrix = lengthOrMatrix;
   spec.target = target;
   spec.commandBase = cmdBase;
+  spec.priority = prio;
+  spec.latch = latch;
   if ((index > -1) && (index < slotCnt)) {
     pos = keyTranslations + index;
     memmove(pos + 1, pos, (freeSlot - pos) * sizeof(KeySpec));
@@ -317,6 +344,12 @@ void KeySpec::printDef() {
   }
   Serial.print(':');
   Serial.print(target); Serial.print(':'); Serial.print(commandBase);
+  if ((priority != prioNormal) || latch) {
+    Serial.print(':'); Serial.print(priority);
+  }
+  if (latch) {
+    Serial.print(F(":1"));
+  }
 }
 
 void commandPress() {
@@ -9,16 +9,12 @@ const int onFlashCount = 8;
  * Holds physical output to be set to the LEDs
  */
 static_assert(outputColumns % 8 == 0, "Number of output columns must be a multiply of 8");
-static_assert((sizeof(unsigned int) * 8) >= outputColumns, "Max 16 columns is supported");
+static_assert(outputShiftRegisters >= 1 && outputShiftRegisters <= 8, "1-8 chained shift registers are supported");
+static_assert(outputRows * outputColumns < 2048, "Output IDs must fit into 11 bits, 0x7ff marks an empty flash slot");
 
 const byte outputRowSize = ((outputColumns + 7) / 8);
 const int maxOutputs = outputRows * outputColumns;
 
-/**
- * Maps S88 sensors to output signals. Initializes to identity function.
- */
-byte (&sensorToOutputMap)[maxOutputs] = eeData.sensorToOutputMap;
-
 /**
  * Bitfield where 1 represnts an output, which will flash when going ON.
  */
@@ -31,9 +27,22 @@ byte (&outputsToFlashOn)[outputByteSize] = eeData.outputsToFlashOn;
 byte physicalOutput[outputByteSize];
 
 /**
- * Value of the current (selected on demux-es) output row, 8 or 16 bits
+ * Requested state of the outputs; unlike `physicalOutput`, a flashing output reads as ON, not as the current flash phase.
+ */
+byte logicalOutput[outputByteSize];
+
+/**
+ * Value of the current (selected on demux-es) output row, one byte per shift register
+ */
+byte outRowValue[outputRowSize];
+
+/**
+ * Port registers of the shift register data and clock pins; shiftOut() with digitalWrite is too slow for wide rows.
  */
-unsigned int outRowValue;
+volatile uint8_t* fbDataPort;
+byte fbDataMask;
+volatile uint8_t* fbClockPort;
+byte fbClockMask;
 
 /**
  * The number of flashing outputs / the top index of the buffer
@@ -44,13 +53,12 @@ byte flashTop = 0;
  * Specifies flashing item
  */
 struct FlashItem {
-  byte kind : 2;      // type of flash
-  byte id : 8;        // id of the output
-  byte count : 4;     // counter; when reaches zero, the output stops flashing
+  uint16_t id : 11;       // id of the output
+  byte count : 4;         // counter; when reaches zero, the output stops flashing
   boolean finalState : 1; // the final output's state
   
-  FlashItem() : kind(0), id(0xff), count(0), finalState(false) {}
-  FlashItem(byte aid, byte acount, boolean aState) : id(aid), count(acount), finalState(aState) {}
+  FlashItem() : id(0x7ff), count(0), finalState(false) {}
+  FlashItem(int aid, byte acount, boolean aState) : id(aid), count(acount), finalState(aState) {}
 };
 
 static_assert(sizeof(FlashItem) <= 2, "FlashItem is too large");
@@ -75,9 +83,11 @@ boolean flashPhase;
 void resetOutput() {
   for (byte i = 0; i < outputByteSize; i++) {
     physicalOutput[i] = 0;
+    logicalOutput[i] = 0;
     outputsToFlashOn[i] = 0;
-    sensorToOutputMap[i] = i;
   }
+  resetSensorMap();
+  resetLogic();
 }
 
 void setupOutputPorts() {
@@ -85,6 +95,10 @@ void setupOutputPorts() {
   pinMode(FbPowerClock, OUTPUT);
   pinMode(FbPowerData, OUTPUT);
   pinMode(FbPowerLatch, OUTPUT);
+  fbDataPort = portOutputRegister(digitalPinToPort(FbPowerData));
+  fbDataMask = digitalPinToBitMask(FbPowerData);
+  fbClockPort = portOutputRegister(digitalPinToPort(FbPowerClock));
+  fbClockMask = digitalPinToBitMask(FbPowerClock);
   resetOutput();
 
   registerLineCommand("FLSH", &commandFlash);
@@ -92,6 +106,10 @@ void setupOutputPorts() {
   registerLineCommand("FDEF", &commandFlashAll);
   registerLineCommand("FDMP", &commandFlashDump);
   registerLineCommand("OUT", &commandOut);
+  registerLineCommand("SMAP", &commandSensorMap);
+  registerLineCommand("SDEL", &commandSensorDel);
+  registerLineCommand("LGC", &commandLogic);
+  registerLineCommand("LDEL", &commandLogicDel);
 }
 
 void printFlashTable() {
@@ -111,7 +129,7 @@ void printFlashTable() {
  * Starts flashing at a certain output. If the output is already flashing,
  * it will continue, with the new timeout
  */
-void addFlashOutput(byte index, byte count, boolean state) {
+void addFlashOutput(int index, byte count, boolean state) {
   if (count > 16) {
     return;
   }
@@ -152,7 +170,7 @@ void addFlashOutput(byte index, byte count, boolean state) {
   printFlashTable();
 }
 
-boolean removeFlashOutput(byte index) {
+boolean removeFlashOutput(int index) {
   if (debugFlashes) {
     Serial.print(F("RemFlash")); Serial.println(index);
     printFlashTable();
@@ -195,7 +213,7 @@ void flipFlashes() {
       if (debugFlashes) {
         Serial.print(F("Toggle #")); Serial.print(p->id); Serial.print(F(" cnt:")); Serial.print(p->count); Serial.print('\t'); Serial.println((int)p, HEX);
       }
-      byte id = p->id;
+      int id = p->id;
       writeBit(physicalOutput, id, flashPhase);
       if (p > d) {
         if (debugFlashes) {
@@ -208,7 +226,7 @@ void flipFlashes() {
       if (debugFlashes) {
         Serial.print(F("Stop #")); Serial.print(p->id); Serial.print(':'); Serial.println(p->finalState);
       }
-      byte id = p->id;
+      int id = p->id;
       writeBit(physicalOutput, id, p->finalState);
       // do not increment d
     }
@@ -220,46 +238,41 @@ void flipFlashes() {
 }
 
 void prepareOutputRow() {
-  if (outputRowSize == 1) {
-    outRowValue = *(physicalOutput + ioRowIndex);
-  } else if (outputRowSize == 2) {
-    outRowValue = *(((unsigned int*)(physicalOutput)) + ioRowIndex);
-  } else {
-    // yet unsupported
-    outRowValue = (ioRowIndex & 0x01) ? 0xaaaa : 0x5555;
+  memcpy(outRowValue, physicalOutput + ioRowIndex * outputRowSize, outputRowSize);
+}
+
+/**
+ * Shifts out one byte, MSB first, directly through the port registers.
+ */
+inline void shiftOutByte(byte v) {
+  for (byte m = 0x80; m != 0; m >>= 1) {
+    if (v & m) {
+      *fbDataPort |= fbDataMask;
+    } else {
+      *fbDataPort &= ~fbDataMask;
+    }
+    *fbClockPort |= fbClockMask;
+    *fbClockPort &= ~fbClockMask;
   }
 }
 
+/**
+ * Shifts the row into the chained registers, lowest byte first (the same order as the former 16-column code).
+ * The loop count is a compile-time constant, so the compiler unrolls it for the usual 1-3 registers.
+ */
 void displayOutputRow() {
   digitalWrite(FbPowerLatch, LOW);
-  if (outputColumns == 8) {
-    shiftOut(FbPowerData, FbPowerClock, MSBFIRST, outRowValue);
-  } else if (outputColumns == 16) {
-    shiftOut(FbPowerData, FbPowerClock, MSBFIRST, outRowValue & 0xff);
-    shiftOut(FbPowerData, FbPowerClock, MSBFIRST, outRowValue >> 8);
-  } else {
-    // unsupported
-    return;
+  for (byte i = 0; i < outputShiftRegisters; i++) {
+    shiftOutByte(outRowValue[i]);
   }
   digitalWrite(FbPowerLatch, HIGH);
   digitalWrite(FbPowerLatch, LOW);
 }
 
-void setOutputFromSensor(byte sensorNumber, boolean state) {
-  if (sensorNumber >= sizeof(sensorToOutputMap)) {
-    return;
-  }
-  byte outId = sensorToOutputMap[sensorNumber];
-  if (debugMatrixOutput) {
-    
-  }
-  Serial.print(F("OutputSet: sens=")); Serial.print(sensorNumber); Serial.print(' '); Serial.print(state); Serial.print(F(" oid:")); Serial.println(outId);
-  setOutput(outId, state);
-}
-
 void setOutput(int outId, boolean state) {
   boolean shouldFlash = readBit(outputsToFlashOn, outId);
   
+  writeBit(logicalOutput, outId, state);
   if (debugMatrixOutput) {
     Serial.print(F(" fl:")); Serial.print(shouldFlash); Serial.print(F(" st:")); Serial.println(state);
   }
@@ -331,7 +344,7 @@ void commandFlashOnOff(boolean turnOn) {
     }
     start--;
     end--;
-    for (byte n = start; n <= end; n++) {
+    for (int n = start; n <= end; n++) {
       writeBit(outputsToFlashOn, n, turnOn);
     }
     Serial.print(F("Set ")); 
@@ -374,7 +387,7 @@ void commandFlashDump() {
   boolean defState = eeData.flashDefault;
   boolean curState = defState;
   
-  byte outNum = 0;
+  int outNum = 0;
   int startNum = -1;
   itemCount = 0;
   for (byte i = 0; i <  outputByteSize; i++) {
@@ -447,8 +460,14 @@ void print8Bits(int a) {
 
 void printMatrixOutput() {
   for (byte r = 0; r < outputRows; r++) {
-    Serial.print('#'); print2Digits(r + 1); Serial.print('['); print3Digits(r * 8 + 1); Serial.print('-'); print3Digits(r * 8 + 1 + 7); Serial.print(F("]:\t")); 
-    print8Bits(physicalOutput[r]);
+    int first = r * outputColumns + 1;
+    Serial.print('#'); print2Digits(r + 1); Serial.print('['); print3Digits(first); Serial.print('-'); print3Digits(first + outputColumns - 1); Serial.print(F("]:\t")); 
+    for (byte i = 0; i < outputRowSize; i++) {
+      if (i > 0) {
+        Serial.print(' ');
+      }
+      print8Bits(physicalOutput[r * outputRowSize + i]);
+    }
     Serial.println();
   }
 }
@@ -5,6 +5,10 @@
  * krok nebo 0xff, pokud se ma provest dalsi krok. Pokud jiz dalsi stav/krok neni, zacne se opet od zacatku.
  * 
  * Kdyz jeste neuplynula prodleva pred dalsim krokem, automat se ihned vraci.
+ *
+ * Moduly mohou byt ve vice retezcich (`S88Inputs`) se spolecnymi hodinami: kazdy takt hodin precte jeden bit z kazdeho
+ * retezce, takze pruchod trva tolik taktu, kolik ma nejdelsi retezec, ne kolik je modulu celkem. Senzory se cisluji po
+ * retezcich: nejdrive moduly retezce 1, za nimi retezce 2 atd.
  */
 
 ///////////////////////// Configuration details for S88 //////////////////////////////////////
@@ -37,6 +41,7 @@ volatile int lastVoltage = 0;
  * Debounced state of the sensors, one bit per sensor. Use bitRead/bitWrite to change data
  */
 byte s88DebouncedState[s88ModuleCount];
+byte s88GatewayDirty[gatewayDirtyBytes(s88ModuleCount)];
 
 /**
  * Specific implemementation of the debouncer: stableChange will propagate the data to output.
@@ -44,11 +49,31 @@ byte s88DebouncedState[s88ModuleCount];
 class S88toOutputDebouncer : public Debouncer {
   public:
   S88toOutputDebouncer(byte modCount, byte* debouncedState) : Debouncer(modCount, debouncedState) {}
-  virtual boolean stableChange(byte number, boolean nState);
+  virtual boolean stableChange(int number, boolean nState);
 };
 
 S88toOutputDebouncer s88Debounce(s88ModuleCount, s88DebouncedState);
 
+/**
+ * Pocet modulu v kazdem retezci
+ */
+byte (&s88ChainModules)[s88MaxChains] = eeData.s88ChainModules;
+
+/**
+ * Cislo prvniho modulu retezce v `s88DebouncedState`
+ */
+byte s88ChainStart[s88MaxChains];
+
+/**
+ * Pocet ctenych modulu, soucet `s88ChainModules`
+ */
+byte s88UsedModules;
+
+/**
+ * Pocet modulu nejdelsiho retezce = pocet byte ctenych v jednom pruchodu
+ */
+byte s88ChainLength;
+
 
 /**
  * State of a S88 automaton. But "state" is greatly overloaded term, so let's have Phase.
@@ -141,7 +166,9 @@ void setupTrackInput() {
 }
 
 void setupS88Ports() {
-  pinMode(S88Input, INPUT);
+  for (byte c = 0; c < s88MaxChains; c++) {
+    pinMode(S88Inputs[c], INPUT);
+  }
   pinMode(S88Clock, OUTPUT);
   pinMode(S88Latch, OUTPUT);
   pinMode(S88ResetAll, OUTPUT);
@@ -155,6 +182,9 @@ void setupS88Ports() {
   setupTrackInput();
 
   registerLineCommand("SENS", &commandTrackSensitivity);
+  registerLineCommand("S88C", &commandS88Chains);
+  setupS88Publish();
+  registerGatewaySource(gatewayS88, s88DebouncedState, s88ModuleCount, s88GatewayDirty);
 
   s88Debounce.setOffCounter(S88OffDebounce);
 }
@@ -163,13 +193,17 @@ void resetS88() {
   for (int i = 0; i < s88ModuleCount; i++) {
     s88DebouncedState[i] = 0;
   }
+  resetS88Publish();
 }
 
-boolean S88toOutputDebouncer::stableChange(byte number, boolean nState) {
+boolean S88toOutputDebouncer::stableChange(int number, boolean nState) {
   if (!Debouncer::stableChange(number, nState)) {
     return false;
   }
-  setOutputFromSensor(number, nState);
+  recordSensorChange(number);
+  recordSensorEvent(number, nState);
+  recordS88Change(number);
+  gatewayChanged(gatewayS88, number >> 3);
   return true;
 }
 
@@ -187,9 +221,9 @@ unsigned long s88LastMicros = 0;
 byte s88WaitMicros = 0;
 
 /**
- * Accumulates received S88 bits
+ * Accumulates received S88 bits, one byte per chain
  */
-byte s88Received;
+byte s88Received[s88MaxChains];
 
 /** 
  *  Counts 0-7 before bits are transferred to change bufer
@@ -202,7 +236,7 @@ byte s88BitCount;
 boolean testS88Input;
 
 /**
- * Module number of the current S88.
+ * Module number of the current S88, within the chain
  */
 byte s88ModuleNumber = 0;
 
@@ -211,39 +245,62 @@ byte s88ModuleNumber = 0;
  */
 unsigned int s88DebounceTime;
 
+/**
+ * Spocita zacatky retezcu a delku pruchodu z `s88ChainModules`. Retezce, ktere by presahly `s88ModuleCount`, se zkrati.
+ */
+void compileS88Chains() {
+  byte start = 0;
+  s88ChainLength = 0;
+  for (byte c = 0; c < s88MaxChains; c++) {
+    s88ChainModules[c] = min(s88ChainModules[c], s88ModuleCount - start);
+    s88ChainStart[c] = start;
+    start += s88ChainModules[c];
+    s88ChainLength = max(s88ChainLength, s88ChainModules[c]);
+  }
+  s88UsedModules = start;
+  s88ModuleNumber = 0;
+  s88CurrentState = 0;
+}
+
+/**
+ * Precte bit retezce `chain`
+ */
+boolean s88ReadBit(byte chain) {
+  if (testS88) {
+    return testS88Input;
+  }
+  int pin = S88Inputs[chain];
+  if (pin > 13) {
+    /**
+     * Interpret approx 2.5V from the analog pin as true
+     */
+    return analogTTLRead(pin);
+  }
+  return digitalRead(pin);
+}
+
 byte s88DataInit() {
   if (debugS88) {
     Serial.println(F("S88: init data"));
   }
-  s88Received = 0;
+  memset(s88Received, 0, sizeof(s88Received));
   s88BitCount = 0;
+  s88ModuleNumber = 0;
   // hodiny presly do stavu HIGH, zatimco PE signal uz byl LOW,
   // takze nejvyssi bit narotoval na Q7 a da se precist.
   return s88ReadData();
 }
 
 byte s88ReadData() {
-  s88Received <<= 1;
-  boolean b;
-  if (testS88) {
-    b = testS88Input;
-  } else {
-    if (S88Input > 13) {
-      /**
-       * Interpret approx 2.5V from the analog pin as true
-       */
-      b = analogTTLRead(S88Input);
-    } else {
-      b = digitalRead(S88Input);
+  for (byte c = 0; c < s88MaxChains; c++) {
+    if (s88ModuleNumber >= s88ChainModules[c]) {
+      continue;
+    }
+    boolean b = s88ReadBit(c);
+    s88Received[c] = (s88Received[c] << 1) | (b ? 0x01 : 0);
+    if (debugS88Pins) {
+      Serial.print(F("S88: Read ")); Serial.print(c); Serial.print('#'); Serial.print(s88ModuleNumber); Serial.print('/'); Serial.print(s88BitCount); Serial.print('='); Serial.println(b);
     }
-    
-  }
-  if (b) {
-    s88Received |= 0x01;
-  }
-  if (debugS88Pins) {
-    Serial.print(F("S88: Read #")); Serial.print(s88ModuleNumber); Serial.print('/'); Serial.print(s88BitCount); Serial.print('='); Serial.println(b);
-    Serial.print(F("S88: recvd:")); Serial.println(s88Received, HEX);
   }
   if (++s88BitCount < 8) {
     return 0x08;
@@ -251,19 +308,25 @@ byte s88ReadData() {
   if (debugS88Pins) {
     Serial.println(F("S88: received full byte"));
   }
-  if (debugS88) {
-    Serial.println(s88Received, BIN); 
+  // process the bytes as a change
+  for (byte c = 0; c < s88MaxChains; c++) {
+    if (s88ModuleNumber >= s88ChainModules[c]) {
+      continue;
+    }
+    if (debugS88) {
+      Serial.print(c); Serial.print(':'); Serial.println(s88Received[c], BIN); 
+    }
+    s88Debounce.debounce(s88ChainStart[c] + s88ModuleNumber, s88Received + c, 1);
   }
-  // process the byte as a change
-  s88Debounce.debounce(s88ModuleNumber, &s88Received, sizeof(s88Received));
-
+  s88BitCount = 0;
   s88ModuleNumber++;
-  if (s88ModuleNumber >= s88ModuleCount) {
+  if (s88ModuleNumber >= s88ChainLength) {
     s88ModuleNumber = 0;
     // advance, wait a little then repeat.
     return 0xff;
   }
-  return 0x07;
+  // dalsi modul: bit 1 prijde s dalsim taktem hodin
+  return 0x08;
 }
 
 byte s88Finish() {
@@ -315,7 +378,9 @@ boolean processS88Bus() {
   if (s88CurrentState == 0) {
     if (elapsedTime(s88DebounceTime, delayBetweenDebounceTick)) {
       s88Debounce.tick();
+      applySensorMap();
     }
+    publishS88Scan();
   }
   return s88CurrentState == 0;
 }
@@ -345,6 +410,50 @@ void commandTrackSensitivity() {
   eeData.minTrackVoltage = limit;
 }
 
+void dumpS88Chains() {
+  Serial.print(F("S88C"));
+  for (byte c = 0; c < s88MaxChains; c++) {
+    Serial.print(':'); Serial.print(s88ChainModules[c]);
+  }
+  Serial.println();
+}
+
+/**
+ * S88C:n1:n2:... nastavi pocet modulu v retezcich S88 (vstupy `S88Inputs`), chybejici retezce maji 0 modulu.
+ * S88C vypise nastaveni.
+ */
+void commandS88Chains() {
+  int n = nextNumber();
+  if (n == -2) {
+    dumpS88Chains();
+    return;
+  }
+  byte mods[s88MaxChains];
+  int total = 0;
+  memset(mods, 0, sizeof(mods));
+  for (byte c = 0; n != -2; c++) {
+    if (c >= s88MaxChains) {
+      Serial.println(F("Too many chains"));
+      return;
+    }
+    if ((n < 0) || (n > s88ModuleCount)) {
+      Serial.println(F("Bad count"));
+      return;
+    }
+    mods[c] = n;
+    total += n;
+    n = nextNumber();
+  }
+  if (total > s88ModuleCount) {
+    Serial.println(F("Too many modules"));
+    return;
+  }
+  memcpy(s88ChainModules, mods, sizeof(mods));
+  compileS88Chains();
+  saveAll();
+  dumpS88Chains();
+}
+
 // ------------------------ Indivudual port manipulations ---------------
 
 byte s88LoadHigh() {
@@ -370,16 +479,7 @@ byte s88ClockHigh() {
   digitalWrite(S88Clock, HIGH);
 
   if (debugS88Pins) {
-    boolean b;
-    if (S88Input > 13) {
-      /**
-       * Interpret approx 2.5V from the analog pin as true
-       */
-      b = analogTTLRead(S88Input);
-    } else {
-      b = digitalRead(S88Input);
-    }
-    Serial.print(F("** Read @clock: ")); Serial.println(b);
+    Serial.print(F("** Read @clock: ")); Serial.println(s88ReadBit(0));
   }
   return 0xff;
 }
@@ -0,0 +1,224 @@
+/**
+ * Publikace obsazeni (stavu S88) na sbernici RS485. Zobrazovac posila zmeny senzoru dalsim zarizenim (navestidla, zabezpecovaci
+ * zarizeni), aby nepotrebovala vlastni odbocku z S88 ani se nemusela dotazovat.
+ *
+ * Zmeny se jen zaznamenavaji do bitoveho pole `s88PendingChange` (z `stableChange` debounceru). Na konci kazdeho pruchodu S88 se
+ * vsechny nahromadene zmeny poslou najednou jako "delta" ramec, nejcasteji ale jednou za `s88DeltaDelay` ms. Kdyz senzor behem teto doby
+ * zmeni stav tam a zpet, posle se jen vysledny stav.
+ *
+ * Format dat:
+ *    delta:    [opSensorDelta] [stav << 7 | cislo senzoru] ...
+ *    snapshot: [opSensorSnapshot] [cislo prvniho modulu] [bity modulu] ...
+ * Snapshot (uplny stav pro resynchronizaci) se posila kazdych `s88SnapshotPeriod` sekund, po castech, ktere se vejdou do prijmoveho
+ * bufferu slave. Kazdy pruchod S88 posle nejvyse jednu cast, aby se nezahltila fronta BusMasteru. Pokud je zmen vice, nez kolik by
+ * zabral cely snapshot, posle se misto delty snapshot.
+ *
+ * Zmena, kterou fronta BusMasteru neprijme (plna fronta, odberatel mimo provoz), zustane cekat a posle se v dalsim pruchodu.
+ * Delta ma ve fronte BusMasteru vyssi prioritu; cast snapshotu nizkou, nahradi se novejsi casti pro stejne moduly a po uplynuti
+ * periody snapshotu se zahodi. Kdyz se odberatel po vypadku opet ozve (`onSlaveUp`), posle se mu hned uplny stav.
+ */
+
+const boolean debugS88Publish = false;
+
+static_assert(s88ModuleCount <= 16, "Delta frame can address at most 128 sensors");
+
+/**
+ * Max delka dat v ramci, ktery jeste prijme slave s bufferem `recvBufferSize`
+ */
+const byte s88MaxPayload = recvBufferSize - (sizeof(len_t) + 2 * sizeof(address_t));
+
+/**
+ * Max delka dat pro odberatele; ramec pro skupinu nese navic masku clenu
+ */
+byte s88TargetPayload() {
+  return isGroup(eeData.s88Target) ? s88MaxPayload - groupHeaderSize : s88MaxPayload;
+}
+
+/**
+ * Senzory, ktere zmenily stav od posledni odeslane delty
+ */
+byte s88PendingChange[s88ModuleCount];
+
+/**
+ * Pocet senzoru v `s88PendingChange`
+ */
+byte s88PendingCount = 0;
+
+/**
+ * Prvni modul dalsi casti snapshotu; od `s88UsedModules` vys se snapshot neposila
+ */
+byte s88SnapshotModule = s88ModuleCount;
+
+unsigned int s88LastDelta = 0;
+unsigned int s88LastSnapshot = 0;
+
+void setupS88Publish() {
+  registerLineCommand("S88P", &commandS88Publish);
+}
+
+void resetS88Publish() {
+  memset(s88PendingChange, 0, sizeof(s88PendingChange));
+  s88PendingCount = 0;
+  s88SnapshotModule = s88ModuleCount;
+}
+
+/**
+ * Zaznamena zmenu senzoru k odeslani. Vola se ze `stableChange`.
+ */
+void recordS88Change(byte sensor) {
+  if (eeData.s88Target == 0) {
+    return;
+  }
+  if (!readBit(s88PendingChange, sensor)) {
+    writeBit(s88PendingChange, sensor, 1);
+    s88PendingCount++;
+  }
+}
+
+/**
+ * Vola se na konci kazdeho pruchodu S88. Odesle nahromadene zmeny a pripadne dalsi cast snapshotu.
+ */
+void publishS88Scan() {
+  if (eeData.s88Target == 0) {
+    return;
+  }
+  if (eeData.s88SnapshotPeriod > 0 && elapsedTime(s88LastSnapshot, eeData.s88SnapshotPeriod * 1000U)) {
+    s88SnapshotModule = 0;
+  }
+  if (s88PendingCount > 0 && elapsedTime(s88LastDelta, eeData.s88DeltaDelay)) {
+    if (s88PendingCount > s88UsedModules + 1) {
+      // vic zmen, nez kolik stoji uplny stav
+      if (s88SnapshotModule >= s88UsedModules) {
+        s88SnapshotModule = 0;
+        recordStartTime(s88LastSnapshot);
+      }
+    } else {
+      sendS88Delta();
+    }
+  }
+  if (s88SnapshotModule < s88UsedModules) {
+    sendS88SnapshotChunk();
+  }
+}
+
+/**
+ * Slave se opet ozval; je-li odberatelem (nebo clenem cilove skupiny), dostane uplny stav.
+ */
+void onSlaveUp(byte t) {
+  byte target = eeData.s88Target;
+  if ((target != t) && !(isGroup(target) && (busGroups[target - addressGroupBase] & (1U << t)))) {
+    return;
+  }
+  s88SnapshotModule = 0;
+  recordStartTime(s88LastSnapshot);
+}
+
+/**
+ * Zaradi delta ramec; zmeny v nem se smazou z `s88PendingChange` az po uspesnem zarazeni, jinak se poslou v dalsim pruchodu.
+ */
+boolean queueS88Delta(const byte* msg, byte len) {
+  // mrtvy odberatel dostane po navratu snapshot (`onSlaveUp`), ktery cekajici zmeny pokryje
+  if (isSlaveDown(eeData.s88Target) || !addMessage(eeData.s88Target, eeData.busId, msg, len, prioHigh, 0, false)) {
+    return false;
+  }
+  for (byte i = 1; i < len; i++) {
+    writeBit(s88PendingChange, msg[i] & 0x7f, 0);
+    s88PendingCount--;
+  }
+  return true;
+}
+
+void sendS88Delta() {
+  byte msg[s88MaxPayload];
+  byte *ptr = msg;
+  *(ptr++) = opSensorDelta;
+  for (byte n = 0; n < s88ModuleCount * 8; n++) {
+    if (!readBit(s88PendingChange, n)) {
+      continue;
+    }
+    *(ptr++) = (readBit(s88DebouncedState, n) ? 0x80 : 0) | n;
+    if (ptr >= msg + s88TargetPayload()) {
+      if (!queueS88Delta(msg, ptr - msg)) {
+        break;
+      }
+      ptr = msg + 1;
+    }
+  }
+  if ((ptr > msg + 1) && (ptr < msg + s88TargetPayload())) {
+    queueS88Delta(msg, ptr - msg);
+  }
+  if (debugS88Publish) {
+    Serial.print(F("S88 delta, left: ")); Serial.println(s88PendingCount);
+  }
+}
+
+void sendS88SnapshotChunk() {
+  byte msg[s88MaxPayload];
+  byte first = s88SnapshotModule;
+  byte cnt = min(s88UsedModules - first, s88TargetPayload() - 2);
+
+  msg[0] = opSensorSnapshot;
+  msg[1] = first;
+  memcpy(msg + 2, s88DebouncedState + first, cnt);
+  // starsi neodeslana cast snapshotu je zastarala; po dalsim snapshotu nema smysl ji posilat
+  addMessage(eeData.s88Target, eeData.busId, msg, cnt + 2, prioLow, eeData.s88SnapshotPeriod * 1000U, true);
+
+  // odeslany stav prekryva i cekajici zmeny techto modulu
+  for (byte i = first; i < first + cnt; i++) {
+    for (byte m = s88PendingChange[i]; m; m &= m - 1) {
+      s88PendingCount--;
+    }
+    s88PendingChange[i] = 0;
+  }
+  s88SnapshotModule = first + cnt;
+  if (debugS88Publish) {
+    Serial.print(F("S88 snapshot: ")); Serial.print(first); Serial.print('+'); Serial.println(cnt);
+  }
+}
+
+void dumpS88Publish() {
+  Serial.print(F("S88P:")); Serial.print(eeData.s88Target); Serial.print(':');
+  Serial.print(eeData.s88DeltaDelay); Serial.print(':'); Serial.println(eeData.s88SnapshotPeriod);
+}
+
+/**
+ * S88P:cil:prodleva:perioda
+ *    cil       - adresa na sbernici, 0 = nepublikovat
+ *    prodleva  - min. ms mezi delta ramci
+ *    perioda   - sekundy mezi uplnymi snapshoty, 0 = jen delta
+ */
+void commandS88Publish() {
+  int target = nextNumber();
+  if (target == -2) {
+    dumpS88Publish();
+    return;
+  }
+  if ((target < 0) || (target == eeData.busId) || ((target >= maxTarget) && !isGroup(target))) {
+    Serial.println(F("Invalid target"));
+    return;
+  }
+  int gap = nextNumber();
+  int period = nextNumber();
+  if (gap == -2) {
+    gap = eeData.s88DeltaDelay;
+  } else if ((gap < 0) || (gap > 250)) {
+    Serial.println(F("Bad delay"));
+    return;
+  }
+  if (period == -2) {
+    period = eeData.s88SnapshotPeriod;
+  } else if ((period < 0) || (period > 60)) {
+    Serial.println(F("Bad period"));
+    return;
+  }
+  eeData.s88Target = target;
+  eeData.s88DeltaDelay = gap;
+  eeData.s88SnapshotPeriod = period;
+  resetS88Publish();
+  if (target > 0) {
+    // novy odberatel dostane hned uplny stav
+    s88SnapshotModule = 0;
+    recordStartTime(s88LastSnapshot);
+  }
+  dumpS88Publish();
+}
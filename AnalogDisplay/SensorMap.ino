@@ -0,0 +1,206 @@
+/**
+ * Mapovani senzoru S88 na vystupy (LED). Mapovani je seznam useku (`SensorRange`): `length` senzoru od `sensorStart` sviti na vystupech
+ * od `outputStart`, pripadne negovane. Pozdejsi usek prepise drivejsi. Vychozi mapovani je identita.
+ *
+ * Useky se po nacteni / zmene prelozi (`compileSensorMap`) na operace nad celymi byte: cast byte senzoru (maska) se posune a zapise
+ * do byte vystupu. Usek zarovnany na byte (nejcastejsi pripad) da jednu operaci na modul S88, nezarovnany nejvyse dve.
+ * Po kazdem tiku debounceru se provedou jen operace pro byte, ve kterych se neco zmenilo (`applySensorMap`). Vystupy, ktere maji blikat,
+ * se nastavuji po jednom pres `setOutput`.
+ */
+
+const boolean debugSensorMap = false;
+
+const byte maxSensorMapOps = 2 * (s88ModuleCount + maxSensorRanges);
+
+
+SensorRange (&sensorRanges)[maxSensorRanges] = eeData.sensorRanges;
+
+/**
+ * Prenos casti byte senzoru do byte vystupu
+ */
+struct SensorMapOp {
+  byte        sensorByte;
+  byte        outByte;
+  signed char shift : 4;      // kladny = doleva
+  boolean     invert : 1;
+  byte        mask;           // bity v byte senzoru
+};
+
+SensorMapOp sensorMapOps[maxSensorMapOps];
+byte sensorMapOpCount = 0;
+
+/**
+ * Senzory zmenene od posledniho `applySensorMap`
+ */
+byte sensorChanged[s88ModuleCount];
+
+void resetSensorMap() {
+  memset(sensorRanges, 0, sizeof(sensorRanges));
+  SensorRange& r = sensorRanges[0];
+  r.length = min(min(s88DefaultModules * 8, maxOutputs), 127);
+  compileSensorMap();
+}
+
+inline byte shiftBits(byte b, signed char shift) {
+  return (shift >= 0) ? (b << shift) : (b >> -shift);
+}
+
+/**
+ * Prelozi useky na operace; false, pokud se nevejdou do `sensorMapOps`.
+ */
+boolean compileSensorMap() {
+  sensorMapOpCount = 0;
+  for (const SensorRange* r = sensorRanges; (r < sensorRanges + maxSensorRanges) && !r->isEmpty(); r++) {
+    byte s = r->sensorStart;
+    int o = r->outputStart;
+    byte left = r->length;
+    while (left > 0) {
+      // kus, ktery nepresahuje hranici byte senzoru ani vystupu
+      byte sbit = s & 0x07;
+      byte obit = o & 0x07;
+      byte n = min(left, 8 - max(sbit, obit));
+      if (sensorMapOpCount >= maxSensorMapOps) {
+        return false;
+      }
+      SensorMapOp& op = sensorMapOps[sensorMapOpCount++];
+      op.sensorByte = s >> 3;
+      op.outByte = o >> 3;
+      op.shift = obit - sbit;
+      op.invert = r->invert;
+      op.mask = ((1 << n) - 1) << sbit;
+      s += n;
+      o += n;
+      left -= n;
+    }
+  }
+  if (debugSensorMap) {
+    Serial.print(F("Sensor map ops: ")); Serial.println(sensorMapOpCount);
+  }
+  // novy stav vsech mapovanych vystupu
+  memset(sensorChanged, 0xff, sizeof(sensorChanged));
+  return true;
+}
+
+void recordSensorChange(byte sensor) {
+  writeBit(sensorChanged, sensor, 1);
+}
+
+/**
+ * Prepise zmenene senzory na vystupy.
+ */
+void applySensorMap() {
+  for (const SensorMapOp* op = sensorMapOps; op < sensorMapOps + sensorMapOpCount; op++) {
+    byte chg = sensorChanged[op->sensorByte] & op->mask;
+    if (chg == 0) {
+      continue;
+    }
+    byte st = s88DebouncedState[op->sensorByte];
+    if (op->invert) {
+      st = ~st;
+    }
+    byte bits = shiftBits(st & op->mask, op->shift);
+    byte outMask = shiftBits(chg, op->shift);
+    byte flash = outMask & outputsToFlashOn[op->outByte];
+    byte plain = outMask & ~flash;
+    byte& out = physicalOutput[op->outByte];
+    out = (out & ~plain) | (bits & plain);
+    byte& logical = logicalOutput[op->outByte];
+    logical = (logical & ~plain) | (bits & plain);
+    for (byte b = 0; flash != 0; b++) {
+      byte m = 1 << b;
+      if (flash & m) {
+        flash &= ~m;
+        setOutput((op->outByte << 3) + b, bits & m);
+      }
+    }
+  }
+  evaluateLogic();
+  memset(sensorChanged, 0, sizeof(sensorChanged));
+}
+
+void SensorRange::printDef() {
+  Serial.print(sensorStart + 1); Serial.print(':'); Serial.print(outputStart + 1); Serial.print(':'); Serial.print(length);
+  if (invert) {
+    Serial.print(F(":1"));
+  }
+}
+
+void dumpSensorMap() {
+  for (byte i = 0; (i < maxSensorRanges) && !sensorRanges[i].isEmpty(); i++) {
+    Serial.print(F("SMAP:")); sensorRanges[i].printDef(); Serial.println();
+  }
+}
+
+/**
+ * SMAP:senzor:vystup:pocet[:1] prida usek mapovani (1 = negace), cisla od 1. SMAP vypise mapovani.
+ */
+void commandSensorMap() {
+  int s = nextNumber();
+  if (s == -2) {
+    dumpSensorMap();
+    return;
+  }
+  int o = nextNumber();
+  int len = nextNumber();
+  int inv = nextNumber();
+  if ((s < 1) || (s > s88ModuleCount * 8)) {
+    Serial.println(F("Bad sensor"));
+    return;
+  }
+  if ((o < 1) || (o > maxOutputs)) {
+    Serial.println(F("Bad output"));
+    return;
+  }
+  if ((len < 1) || (len > 127) || (s + len - 1 > s88ModuleCount * 8) || (o + len - 1 > maxOutputs)) {
+    Serial.println(F("Bad length"));
+    return;
+  }
+  if (inv == -2) {
+    inv = 0;
+  } else if ((inv < 0) || (inv > 1)) {
+    Serial.println(F("Bad invert flag"));
+    return;
+  }
+  byte i = 0;
+  while ((i < maxSensorRanges) && !sensorRanges[i].isEmpty()) {
+    i++;
+  }
+  if (i >= maxSensorRanges) {
+    Serial.println(F("No free slots"));
+    return;
+  }
+  SensorRange& r = sensorRanges[i];
+  r.sensorStart = s - 1;
+  r.outputStart = o - 1;
+  r.length = len;
+  r.invert = inv;
+  if (!compileSensorMap()) {
+    r.length = 0;
+    compileSensorMap();
+    Serial.println(F("Map too complex"));
+    return;
+  }
+  saveAll();
+  Serial.print(F("Defined map: ")); Serial.print(i + 1); Serial.print(':'); r.printDef(); Serial.println();
+}
+
+/**
+ * SDEL:n smaze n-ty usek mapovani (poradi podle SMAP).
+ */
+void commandSensorDel() {
+  int n = nextNumber();
+  byte cnt = 0;
+  while ((cnt < maxSensorRanges) && !sensorRanges[cnt].isEmpty()) {
+    cnt++;
+  }
+  if ((n < 1) || (n > cnt)) {
+    Serial.println(F("Bad index"));
+    return;
+  }
+  SensorRange save = sensorRanges[n - 1];
+  memmove(sensorRanges + n - 1, sensorRanges + n, (cnt - n) * sizeof(SensorRange));
+  sensorRanges[cnt - 1].length = 0;
+  compileSensorMap();
+  saveAll();
+  Serial.print(F("Deleted: ")); save.printDef(); Serial.println();
+}
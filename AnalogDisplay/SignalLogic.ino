@@ -0,0 +1,469 @@
+/**
+ * Odvozene indikace: vystup je logickou funkci senzoru S88, jinych vystupu a zpetnych hlaseni slave (blok je obsazen, kdyz je obsazen kterykoliv jeho usek;
+ * svetlo cesty = obsazeni AND poloha vyhybky, ...).
+ *
+ * Vyrazy jsou v EEPROM (`logicCode`) jako postfixovy (RPN) bytecode, jeden za druhym, ukonceny `lopEnd`:
+ *    1sssssss        - hodnota senzoru s (0-127)
+ *    lopOutput nl nh - hodnota vystupu n (2 byte, LSB prvni); blikajici vystup je 1 (`logicalOutput`), ne faze blikani
+ *    lopFeedback nl nh - zpetne hlaseni n (slave * maxFeedbackBits + cislo hlaseni)
+ *    lopAnd, lopOr, lopXor, lopNot
+ *    lopSet nl nh    - vysledek na vystup n; konci vyraz
+ * Zasobnik je bitovy (unsigned int), hloubka max 16.
+ *
+ * Po nacteni / zmene se vyrazy prelozi (`compileLogic`): zacatky vyrazu a index zavislosti - pro kazdy vstupni byte (byte senzoru,
+ * byte vystupu nebo byte zpetnych hlaseni) seznam vyrazu, ktere z nej ctou. Po tiku S88 se prepocitaji jen vyrazy zavisle na zmenenych byte. Vyraz, ktery
+ * zmeni vystup, muze zmenit vstup jinych vyrazu; proto se vyhodnocuje opakovane, nejvyse `maxLogicPasses` krat (ochrana pred cyklem).
+ * Zmena zpetneho hlaseni (`onSlaveFeedback`) oznaci zavisle vyrazy; prepocitaji se pri pristim tiku S88.
+ */
+
+const boolean debugLogic = false;
+
+const byte lopEnd = 0;
+const byte lopAnd = 1;
+const byte lopOr = 2;
+const byte lopXor = 3;
+const byte lopNot = 4;
+const byte lopOutput = 8;
+const byte lopSet = 9;
+const byte lopFeedback = 10;
+const byte lopSensor = 0x80;
+
+const byte maxLogicPasses = 4;
+const byte maxLogicDepth = sizeof(unsigned int) * 8;
+
+/**
+ * Vstupni byte: nejdrive byte senzoru, pak byte vystupu, pak byte zpetnych hlaseni
+ */
+const byte logicFeedbackBase = s88ModuleCount + outputByteSize;
+const byte logicInputBytes = logicFeedbackBase + maxSlaves * feedbackSlaveBytes;
+
+/**
+ * Velikost bitove masky ctenych vstupnich byte
+ */
+const byte logicInputMaskSize = (logicInputBytes + 7) / 8;
+
+static_assert(s88ModuleCount + (int)outputByteSize + maxSlaves * feedbackSlaveBytes < 255, "Input bytes must fit into byte");
+
+byte (&logicCode)[logicCodeSize] = eeData.logicCode;
+
+byte logicExprStart[maxLogicExprs];
+byte logicExprCount = 0;
+
+/**
+ * Index zavislosti: vyrazy zavisle na vstupnim byte i jsou `logicDeps[logicDepStart[i]]` .. `logicDeps[logicDepStart[i + 1] - 1]`
+ */
+byte logicDepStart[logicInputBytes + 1];
+byte logicDeps[maxLogicDeps];
+
+byte logicDirty[(maxLogicExprs + 7) / 8];
+byte logicResult[(maxLogicExprs + 7) / 8];
+
+/**
+ * Stav vystupu pri poslednim vyhodnoceni; rozdil = zmeneny vstup
+ */
+byte logicOutputSeen[outputByteSize];
+
+/**
+ * Po prekladu se vysledky zapisi na vystupy bez ohledu na predchozi hodnotu
+ */
+boolean logicForceWrite = false;
+
+void resetLogic() {
+  memset(logicCode, 0, sizeof(logicCode));
+  compileLogic();
+}
+
+/**
+ * Delka instrukce na pozici `pc`
+ */
+byte logicInstrSize(byte pc) {
+  byte op = logicCode[pc];
+  return ((op == lopOutput) || (op == lopSet) || (op == lopFeedback)) ? 3 : 1;
+}
+
+/**
+ * Cislo vystupu - operand instrukce na pozici `pc`
+ */
+inline int logicOperand(byte pc) {
+  return logicCode[pc + 1] | (logicCode[pc + 2] << 8);
+}
+
+/**
+ * Konec programu (pozice `lopEnd`)
+ */
+byte logicCodeEnd() {
+  byte pc = 0;
+  while ((pc < logicCodeSize) && (logicCode[pc] != lopEnd)) {
+    pc += logicInstrSize(pc);
+  }
+  return min(pc, logicCodeSize - 1);
+}
+
+/**
+ * Zkontroluje vyraz od `pc` a vrati pozici za nim (za `lopSet`); 0 = chybny vyraz. `inputs` = maska ctenych vstupnich byte.
+ */
+byte checkLogicExpr(byte pc, byte* inputs) {
+  byte depth = 0;
+  memset(inputs, 0, logicInputMaskSize);
+  while (pc < logicCodeSize) {
+    byte op = logicCode[pc];
+    if (op & lopSensor) {
+      byte s = op & ~lopSensor;
+      if ((s >= s88ModuleCount * 8) || (depth >= maxLogicDepth)) {
+        return 0;
+      }
+      writeBit(inputs, s >> 3, 1);
+      depth++;
+      pc++;
+      continue;
+    }
+    if ((op == lopOutput) || (op == lopSet)) {
+      if ((pc + 2 >= logicCodeSize) || (logicOperand(pc) >= maxOutputs)) {
+        return 0;
+      }
+    }
+    if (op == lopFeedback) {
+      if ((pc + 2 >= logicCodeSize) || (logicOperand(pc) >= maxSlaves * maxFeedbackBits)) {
+        return 0;
+      }
+    }
+    switch (op) {
+      case lopOutput:
+        if (depth >= maxLogicDepth) {
+          return 0;
+        }
+        writeBit(inputs, s88ModuleCount + (logicOperand(pc) >> 3), 1);
+        depth++;
+        break;
+      case lopFeedback:
+        if (depth >= maxLogicDepth) {
+          return 0;
+        }
+        writeBit(inputs, logicFeedbackBase + (logicOperand(pc) >> 3), 1);
+        depth++;
+        break;
+      case lopSet:
+        return (depth == 1) ? pc + 3 : 0;
+      case lopNot:
+        if (depth < 1) {
+          return 0;
+        }
+        break;
+      case lopAnd: case lopOr: case lopXor:
+        if (depth < 2) {
+          return 0;
+        }
+        depth--;
+        break;
+      default:
+        return 0;
+    }
+    pc += logicInstrSize(pc);
+  }
+  return 0;
+}
+
+/**
+ * Prelozi program: zacatky vyrazu a index zavislosti. False, pokud je program chybny nebo se nevejde.
+ */
+boolean compileLogic() {
+  byte pc = 0;
+  byte depCount = 0;
+  byte inputs[logicInputMaskSize];
+
+  logicExprCount = 0;
+  memset(logicDepStart, 0, sizeof(logicDepStart));
+  // 1. pruchod: pocty zavislosti pro kazdy vstupni byte
+  while ((pc < logicCodeSize) && (logicCode[pc] != lopEnd)) {
+    byte next = checkLogicExpr(pc, inputs);
+    if ((next == 0) || (logicExprCount >= maxLogicExprs)) {
+      logicExprCount = 0;
+      return false;
+    }
+    logicExprStart[logicExprCount++] = pc;
+    for (byte i = 0; i < logicInputBytes; i++) {
+      if (readBit(inputs, i)) {
+        logicDepStart[i + 1]++;
+        depCount++;
+      }
+    }
+    pc = next;
+  }
+  if (depCount > maxLogicDeps) {
+    logicExprCount = 0;
+    return false;
+  }
+  for (byte i = 0; i < logicInputBytes; i++) {
+    logicDepStart[i + 1] += logicDepStart[i];
+  }
+  // 2. pruchod: vyplni seznamy
+  byte fill[logicInputBytes];
+  memcpy(fill, logicDepStart, sizeof(fill));
+  for (byte e = 0; e < logicExprCount; e++) {
+    checkLogicExpr(logicExprStart[e], inputs);
+    for (byte i = 0; i < logicInputBytes; i++) {
+      if (readBit(inputs, i)) {
+        logicDeps[fill[i]++] = e;
+      }
+    }
+  }
+  if (debugLogic) {
+    Serial.print(F("Logic exprs: ")); Serial.print(logicExprCount); Serial.print(F(" deps: ")); Serial.println(depCount);
+  }
+  memset(logicDirty, 0xff, sizeof(logicDirty));
+  memcpy(logicOutputSeen, logicalOutput, sizeof(logicOutputSeen));
+  logicForceWrite = true;
+  return true;
+}
+
+void markLogicDeps(byte inputByte) {
+  for (byte d = logicDepStart[inputByte]; d < logicDepStart[inputByte + 1]; d++) {
+    writeBit(logicDirty, logicDeps[d], 1);
+  }
+}
+
+/**
+ * Zmena zpetneho hlaseni slave `t`; zavisle vyrazy se prepocitaji pri pristim `evaluateLogic`.
+ */
+void onSlaveFeedback(byte t, byte n, boolean state) {
+  markLogicDeps(logicFeedbackBase + t * feedbackSlaveBytes + (n >> 3));
+  gatewayChanged(gatewayFeedback, t * feedbackSlaveBytes + (n >> 3));
+}
+
+/**
+ * Vyhodnoti vyraz; do `out` ulozi cilovy vystup.
+ */
+boolean evalLogicExpr(byte pc, int& out) {
+  unsigned int stack = 0;
+  for (;;) {
+    byte op = logicCode[pc++];
+    if (op & lopSensor) {
+      stack = (stack << 1) | readBit(s88DebouncedState, op & ~lopSensor);
+      continue;
+    }
+    byte top = stack & 1;
+    switch (op) {
+      case lopOutput:
+        stack = (stack << 1) | readBit(logicalOutput, logicOperand(pc - 1));
+        pc += 2;
+        break;
+      case lopFeedback:
+        stack = (stack << 1) | readBit(&slaveFeedback[0][0], logicOperand(pc - 1));
+        pc += 2;
+        break;
+      case lopSet:
+        out = logicOperand(pc - 1);
+        return top;
+      case lopNot:
+        stack ^= 1;
+        break;
+      case lopAnd:
+        stack >>= 1;
+        stack &= ~1U | top;
+        break;
+      case lopOr:
+        stack >>= 1;
+        stack |= top;
+        break;
+      case lopXor:
+        stack >>= 1;
+        stack ^= top;
+        break;
+    }
+  }
+}
+
+/**
+ * Prepocita vyrazy zavisle na zmenenych senzorech (`sensorChanged`) a vystupech. Vola se z `applySensorMap`.
+ */
+void evaluateLogic() {
+  if (logicExprCount == 0) {
+    return;
+  }
+  for (byte i = 0; i < s88ModuleCount; i++) {
+    if (sensorChanged[i] != 0) {
+      markLogicDeps(i);
+    }
+  }
+  for (byte pass = 0; pass < maxLogicPasses; pass++) {
+    for (byte i = 0; i < outputByteSize; i++) {
+      if (logicalOutput[i] != logicOutputSeen[i]) {
+        logicOutputSeen[i] = logicalOutput[i];
+        markLogicDeps(s88ModuleCount + i);
+      }
+    }
+    boolean changed = false;
+    for (byte e = 0; e < logicExprCount; e++) {
+      if (!readBit(logicDirty, e)) {
+        continue;
+      }
+      writeBit(logicDirty, e, 0);
+      int out;
+      boolean v = evalLogicExpr(logicExprStart[e], out);
+      if (!logicForceWrite && (v == readBit(logicResult, e))) {
+        continue;
+      }
+      writeBit(logicResult, e, v);
+      setOutput(out, v);
+      changed = true;
+    }
+    logicForceWrite = false;
+    if (!changed) {
+      break;
+    }
+  }
+}
+
+/**
+ * Vypise vyraz od `pc` ve tvaru prikazu LGC; vrati pozici za nim.
+ */
+byte printLogicExpr(byte pc) {
+  byte next = pc;
+  while (logicCode[next] != lopSet) {
+    next += logicInstrSize(next);
+  }
+  Serial.print(F("LGC:")); Serial.print(logicOperand(next) + 1);
+  for (; pc < next; pc += logicInstrSize(pc)) {
+    byte op = logicCode[pc];
+    Serial.print(':');
+    if (op & lopSensor) {
+      Serial.print('s'); Serial.print((op & ~lopSensor) + 1);
+      continue;
+    }
+    switch (op) {
+      case lopOutput: Serial.print('o'); Serial.print(logicOperand(pc) + 1); break;
+      case lopFeedback:
+        Serial.print('f'); Serial.print(logicOperand(pc) / maxFeedbackBits); Serial.print('.'); Serial.print(logicOperand(pc) % maxFeedbackBits + 1);
+        break;
+      case lopAnd:    Serial.print('&'); break;
+      case lopOr:     Serial.print('|'); break;
+      case lopXor:    Serial.print('^'); break;
+      case lopNot:    Serial.print('!'); break;
+    }
+  }
+  Serial.println();
+  return next + 3;
+}
+
+void dumpLogic() {
+  for (byte e = 0; e < logicExprCount; e++) {
+    printLogicExpr(logicExprStart[e]);
+  }
+}
+
+/**
+ * LGC:vystup:vyraz prida vyraz pro vystup, cisla od 1. Vyraz je postfixovy, prvky oddelene ':'
+ *    sN        - senzor N
+ *    oN        - vystup N
+ *    fS.N      - zpetne hlaseni N od slave S (FBK)
+ *    &, |, ^   - AND, OR, XOR dvou predchozich hodnot
+ *    !         - negace predchozi hodnoty
+ * Napr. LGC:20:s1:s2:|:s3:| - vystup 20 sviti, kdyz je obsazen kterykoliv ze senzoru 1-3.
+ * LGC bez parametru vypise vsechny vyrazy.
+ */
+void commandLogic() {
+  int out = nextNumber();
+  if (out == -2) {
+    dumpLogic();
+    return;
+  }
+  if ((out < 1) || (out > maxOutputs)) {
+    Serial.println(F("Bad output"));
+    return;
+  }
+  byte start = logicCodeEnd();
+  byte pc = start;
+  while (*inputPos) {
+    char* colon = strchr(inputPos, ':');
+    if (colon == NULL) {
+      colon = inputPos + strlen(inputPos);
+    } else {
+      *colon = 0;
+      colon++;
+    }
+    if (pc + 7 > logicCodeSize) {
+      Serial.println(F("Program full"));
+      logicCode[start] = lopEnd;
+      return;
+    }
+    char c = *inputPos;
+    int n = atoi(inputPos + 1);
+    switch (c) {
+      case 's':
+        if ((n < 1) || (n > s88ModuleCount * 8)) {
+          Serial.println(F("Bad sensor"));
+          logicCode[start] = lopEnd;
+          return;
+        }
+        logicCode[pc++] = lopSensor | (n - 1);
+        break;
+      case 'o':
+        if ((n < 1) || (n > maxOutputs)) {
+          Serial.println(F("Bad output"));
+          logicCode[start] = lopEnd;
+          return;
+        }
+        logicCode[pc++] = lopOutput;
+        logicCode[pc++] = (n - 1) & 0xff;
+        logicCode[pc++] = (n - 1) >> 8;
+        break;
+      case 'f': {
+        char* dot = strchr(inputPos, '.');
+        int fb = (dot == NULL) ? 0 : atoi(dot + 1);
+        if ((n < 1) || (n >= maxSlaves) || (fb < 1) || (fb > maxFeedbackBits)) {
+          Serial.println(F("Bad feedback"));
+          logicCode[start] = lopEnd;
+          return;
+        }
+        int f = n * maxFeedbackBits + fb - 1;
+        logicCode[pc++] = lopFeedback;
+        logicCode[pc++] = f & 0xff;
+        logicCode[pc++] = f >> 8;
+        break;
+      }
+      case '&': case '*':
+        logicCode[pc++] = lopAnd; break;
+      case '|': case '+':
+        logicCode[pc++] = lopOr; break;
+      case '^':
+        logicCode[pc++] = lopXor; break;
+      case '!':
+        logicCode[pc++] = lopNot; break;
+      default:
+        Serial.println(F("Bad term"));
+        logicCode[start] = lopEnd;
+        return;
+    }
+    inputPos = colon;
+  }
+  logicCode[pc++] = lopSet;
+  logicCode[pc++] = (out - 1) & 0xff;
+  logicCode[pc++] = (out - 1) >> 8;
+  logicCode[pc] = lopEnd;
+  if (!compileLogic()) {
+    logicCode[start] = lopEnd;
+    compileLogic();
+    Serial.println(F("Bad expression"));
+    return;
+  }
+  saveAll();
+  Serial.print(F("Defined logic: ")); Serial.print(logicExprCount); Serial.print(':'); printLogicExpr(start);
+}
+
+/**
+ * LDEL:n smaze n-ty vyraz (poradi podle LGC).
+ */
+void commandLogicDel() {
+  int n = nextNumber();
+  if ((n < 1) || (n > logicExprCount)) {
+    Serial.println(F("Bad index"));
+    return;
+  }
+  byte start = logicExprStart[n - 1];
+  byte end = (n < logicExprCount) ? logicExprStart[n] : logicCodeEnd();
+  Serial.print(F("Deleted: ")); printLogicExpr(start);
+  memmove(logicCode + start, logicCode + end, logicCodeSize - end);
+  memset(logicCode + logicCodeSize - (end - start), 0, end - start);
+  compileLogic();
+  saveAll();
+}
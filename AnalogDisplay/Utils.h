@@ -8,6 +8,10 @@ const byte inputColumnsRounded = ((inputColumns + 7) / 8) * 8;
 const byte inputByteSize = (inputRows * inputColumns + 7) / 8;
 
 const byte addressBroadcast = 0xff;
+/**
+ * Adresa prvni skupiny slave; skupiny nasleduji za sebou
+ */
+const byte addressGroupBase = 0x10;
 
 #ifdef FAST_ADDREESS
 #if defined(__AVR_ATmega328P__)  // Arduino UNO, NANO
@@ -77,7 +81,7 @@ boolean readBit(const byte* storage, int index) {
   return (*(storage + i) & m) > 0;
 }
 
-boolean writeBit(const byte* storage, int index, boolean state) {
+void writeBit(byte* storage, int index, boolean state) {
   byte i = index >> 3;
   byte m = 1 << (index & 0x07);
   byte *p = storage + i;
@@ -89,6 +93,16 @@ boolean writeBit(const byte* storage, int index, boolean state) {
   }
 }
 
+/**
+ * Tridy priority packetu ve fronte. Vyssi trida se odesila drive.
+ */
+enum BusPriority {
+  prioLow = 0,
+  prioNormal,
+  prioHigh,
+  prioUrgent
+};
+
 /** 
  *  Translation of physical keys into target:command
  */
@@ -98,7 +112,9 @@ struct KeySpec {
   boolean matrix : 1 ;      // 1
   byte  lenOrMatrix : 8;    // 8
   byte  commandBase : 6;    
-  byte  target : 5;         // 5 ... 2 bit remain
+  byte  target : 5;         // 5
+  byte  priority : 2;       // 2, BusPriority
+  boolean latch : 1;        // 1 prepinac: novejsi stav nahradi neodeslany
 
   boolean isEmpty() {
     return target == 0;
@@ -111,6 +127,8 @@ struct KeySpec {
     lenOrMatrix = len;
     target = t;
     commandBase = b;
+    priority = prioNormal;
+    latch = 0;
   }
 
   void rectangle(byte ax, byte ay, byte w, byte h, byte t, byte b) {
@@ -119,6 +137,8 @@ struct KeySpec {
     lenOrMatrix = w | (h << 4);
     target = t;
     commandBase = b;
+    priority = prioNormal;
+    latch = 0;
     Serial.print("Rectangle: "); Serial.println(lenOrMatrix, HEX);
   }
 
@@ -127,12 +147,46 @@ struct KeySpec {
 
 static_assert(sizeof(KeySpec) > 3, "Large keyspec");
 
+/**
+ * Usek senzoru S88 mapovany na souvisly usek vystupu, volitelne s negaci. Cisla od 0.
+ */
+struct SensorRange {
+  byte    sensorStart;
+  unsigned int outputStart;
+  byte    length : 7;     // 0 = volna polozka
+  boolean invert : 1;
+
+  boolean isEmpty() const {
+    return length == 0;
+  }
+
+  void printDef();
+};
+
 
 byte analogTTLRead(byte pin) {
   // divided by 5V (full range), threshold 3V
   return (analogRead(pin) > ((1024 / 50) * 30)) ? 1 : 0;
 }
 
+/**
+ * Kod operace, prvni byte dat v packetu
+ */
+enum RemoteOperation {
+  /**
+   * Zkouska, zda slave zije; slave jen potvrdi
+   */
+  opProbe = 0,
+  opKeyCommand = 1,
+  opSensorDelta = 2,
+  opSensorSnapshot = 3,
+  opKeySnapshot = 4,
+  /**
+   * Predani pesku (tokenu) dalsimu masteru na sbernici, viz BusMaster
+   */
+  opToken = 5
+};
+
 struct RemoteCommand {
   byte    operation;
   byte    commandId;
@@ -141,4 +195,23 @@ struct RemoteCommand {
   RemoteCommand(byte aop, byte acommand, boolean apress) : operation(aop), commandId(acommand), pressed(apress) {}
 };
 
+/**
+ * Prikaz klavesy do `msg`, vrati delku dat. Prikaz pod 128 se posle v kompaktnim tvaru [opKeyCommand] [stav << 7 | prikaz]:
+ * kod operace se prenese v byte delky ramce, takze klavesa stoji na drate 6 byte (pro prikaz pod 125 bez escape).
+ * Vyssi prikazy se posilaji jako RemoteCommand; slave oba tvary rozlisi podle delky. Prikaz nad 255 se zakodovat neda, vrati 0.
+ */
+byte encodeKeyCommand(byte* msg, int command, boolean pressed) {
+  if ((command < 0) || (command > 0xff)) {
+    return 0;
+  }
+  if (command < 0x80) {
+    msg[0] = opKeyCommand;
+    msg[1] = (pressed ? 0x80 : 0) | command;
+    return 2;
+  }
+  RemoteCommand cmd(opKeyCommand, command, pressed);
+  memcpy(msg, &cmd, sizeof(cmd));
+  return sizeof(cmd);
+}
+
 
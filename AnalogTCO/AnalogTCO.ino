@@ -149,7 +149,11 @@ void setup() {
   Serial.begin(115200);
   setupPorts();
   
+  setupBusMaster();
+  setupBusMonitor();
+  setupGateway();
   resetBusMaster();
+  setupKeySync();
   resetInput();
   checkInitEEPROM();
   loadAll();
@@ -184,25 +188,29 @@ void loadAll() {
 }
 
 /**
- * Casovac pro zpracovani radek klavesnice.
+ * Casovac pro cteni klavesnice.
  */
 unsigned int lastIORowStart = 0;
 
 /**
- * Zpracuje jeden radek klavesnice a vystupu, ale nejdrive za
- * `ioRowSwitchDelay` milisekund; to zajisti urcitou dobu sviceni
- * LEDek v radku
+ * Precte najednou vsechny radky klavesnice, kazdych `keyScanPeriod` ms, v klidu
+ * kazdych `keyIdleScanPeriod` ms. Zpozdeni stisku tak nezavisi na tom, kolikrat
+ * probehne loop(). Vysilani ramce (`transmitFrames`) ale muze smycku zdrzet az
+ * o `maxContinuousTransfer` ms, o tolik se muze cteni opozdit.
  */
-void shiftIORow() {
-  if (!elapsedTime(lastIORowStart, ioRowSwitchDelay)) {
+void scanIORows() {
+  if (!elapsedTime(lastIORowStart, isKeyboardIdle() ? keyIdleScanPeriod : keyScanPeriod)) {
     return;
   }
-  
-  selectDemuxLine(ioRowIndex);
-  
-  processInputRow();
-  ioRowIndex = (ioRowIndex + 1) % inputRows;
-//  ioRowIndex = 0;
+  unsigned long t = micros();
+  startKeyScan(t);
+  for (ioRowIndex = 0; ioRowIndex < inputRows; ioRowIndex++) {
+    selectDemuxLine(ioRowIndex);
+    delayMicroseconds(demuxSettleTime);
+    processInputRow();
+  }
+  ioRowIndex = 0;
+  tickInputDebouncer(micros() - t);
 }
 
 const boolean testOnly = true;
@@ -211,7 +219,8 @@ extern volatile long  intCount;
 void loop() {
   updateTime();
     
-  shiftIORow();
+  scanIORows();
+  processKeySync();
   updateTime();
   transmitFrames();
 
@@ -221,6 +230,7 @@ void loop() {
   updateTime();
 //  flipFlashes();
   processTerminal();
+  processGateway();
 }
 
 void commandClear() {
@@ -263,6 +273,8 @@ void commandSave() {
 
 void commandDumpAll() {
   commandShowKeys();
+  dumpFastKeys();
+  dumpBusGroups();
 }
 
 void printFeatures() {
@@ -1,10 +1,11 @@
 
 /**
- * Delay after one I/O row was processed, outputs are lit and before
- * the processing changes io demux to the next row.
+ * Perioda cteni cele klavesnice [ms]; v klidu (zadna zmena po `keyIdleTime` ms)
+ * se klavesnice cte jen kazdych `keyIdleScanPeriod` ms.
  */
-const int ioRowSwitchDelay = 0;
-//const int ioRowSwitchDelay = 1000;
+const int keyScanPeriod = 5;
+const int keyIdleScanPeriod = 40;
+const int keyIdleTime = 2000;
 const int keyboardDebounceTime = 50;
 const int maxContinuousTransfer = 30;
 
@@ -85,9 +86,18 @@ const int DemuxAddr2 = 9;
 const int DemuxAddr1 = 10;
 const int DemuxAddr0 = 11;
 
+/**
+ * Doba ustaleni radku po prepnuti demultiplexeru [us]
+ */
+const int demuxSettleTime = 5;
+
 
 const byte inputRows = 16;
-const byte inputColumns = 8;
+/**
+ * Pocet zretezenych vstupnich posuvnych registru na radek; sloupcu klavesnice je 8x tolik
+ */
+const byte inputShiftRegisters = 1;
+const byte inputColumns = inputShiftRegisters * 8;
 
 static_assert(inputRows == 8 || inputRows == 16, "Either 8 or 16 rows must be selected");
 
@@ -103,6 +113,11 @@ const byte outputByteSize = (outputRows * outputColumns + 7) / 8;
 
 const byte maxTarget = 16;
 
+/**
+ * Pocet skupin slave na sbernici (skupinove adresy)
+ */
+const byte maxBusGroups = 4;
+
 const int majorVersion = 0;
 const int minorVersion = 1;
 
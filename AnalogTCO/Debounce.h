@@ -32,16 +32,20 @@ class Debouncer {
    */
   byte* curNibble;
 
-  void reportChange(byte number, boolean nState);
+  void reportChange(int number, boolean nState);
 
   protected:
   virtual void reportByteChange(byte n8, byte state, byte mask);
+  /**
+   * Ceka vstup `number` na ustaleni (bezi pocitadlo) ?
+   */
+  boolean isPending(int number);
   /**
    * Vola se pokud je zmena stabilni.
    * @param number cislo vstupu
    * @param nState novy stav
    */
-  virtual boolean stableChange(byte number, boolean nState);
+  virtual boolean stableChange(int number, boolean nState);
 
   public:
   /**
@@ -23,14 +23,12 @@ inline byte writeNibble(byte* a, byte index, byte val) {
 
 
 Debouncer::Debouncer(byte aCount, byte* aState) : stateBytes(aCount), stableState(aState), onCounter(4), offCounter(4) {
-  byte s = aCount * 2 + (aCount * 4);
+  int s = aCount * 2 + (aCount * 4);
   changes = new byte[s];
   rawState = changes + aCount;
   counterNibbles = rawState + aCount;
 
-  for (byte c = s, *p = changes; c > 0; p++, c--) {
-    *p = 0;
-  }
+  memset(changes, 0, s);
   for (byte *nb = counterNibbles; nb < (counterNibbles + ((aCount + 1) / 2)); nb++) {
     *nb = 0;
   }
@@ -69,7 +67,7 @@ void Debouncer::debounce(byte inputStart8, const byte* raw, byte rawByteSize) {
 
 void Debouncer::reportByteChange(byte n8, byte nstate, byte mask) {
   byte x = mask;
-  byte n = n8 << 3;
+  int n = n8 << 3;
   if (debugDebouncer) {
     Serial.print(F("s88byte: n8:")); Serial.print(n8); Serial.print(F(" n:")); Serial.print(n); Serial.print(F(" r:")); Serial.print(nstate, BIN); Serial.print(F(" x:")); Serial.println(x, BIN);
   }
@@ -87,13 +85,17 @@ void Debouncer::reportByteChange(byte n8, byte nstate, byte mask) {
   changes[n8] |= mask;
 }
 
-void Debouncer::reportChange(byte n, boolean state) {
+void Debouncer::reportChange(int n, boolean state) {
   if (debugDebouncer) {
     Serial.print(F("s88Change: n:")); Serial.print(n); Serial.print(" c:"); Serial.print(state ? onCounter : offCounter); Serial.print(F(" s:")); Serial.println(state);
   }
   writeNibble(curNibble, n, state ? onCounter : offCounter);
 }
 
+boolean Debouncer::isPending(int n) {
+  return readNibble(counterNibbles + (n / 2), n) > 0;
+}
+
 byte dummyByte;
 
 void Debouncer::tick() {
@@ -108,7 +110,7 @@ void Debouncer::tick() {
       cn += 4;
       continue;
     }
-    byte n = i * 8;
+    int n = i * 8;
     byte rs = rawState[i];
     byte mask = 0x01;
     curNibble = cn;
@@ -145,7 +147,7 @@ void Debouncer::tick() {
   print();
 }
 
-boolean Debouncer::stableChange(byte input, boolean state) {
+boolean Debouncer::stableChange(int input, boolean state) {
     if (stableState != NULL) {
       if (readBit(stableState, input) == state) {
         return false;
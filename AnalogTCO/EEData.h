@@ -6,9 +6,14 @@
 
 struct EEData {
   KeySpec   keyTranslations[maxKeyTranslations];
+  byte      keyFast[inputByteSize];
   byte      sensorToOutputMap[outputRows * outputColumns];
   byte      outputsToFlashOn[outputByteSize];
   byte      busId;
+  unsigned int busGroups[maxBusGroups];
+  unsigned int busMasters;
+  unsigned int feedbackSlaves;
+  unsigned int foldSlaves;
   boolean   flashDefault;
   int       minTrackVoltage;
   int       minTrackPercent;
@@ -17,7 +22,7 @@ struct EEData {
   byte      enableS88 : 1;
   byte      enableTrack : 1;
 
-  EEData() : flashDefault(false), busId(1), minTrackVoltage(40), minTrackPercent(20), enableKeys(1), enableS88(1), enableTrack(1) {}
+  EEData() : flashDefault(false), busId(1), busGroups(), busMasters(0), feedbackSlaves(0), foldSlaves(0), keyFast(), minTrackVoltage(40), minTrackPercent(20), enableKeys(1), enableS88(1), enableTrack(1) {}
 };
 
 extern EEData eeData;
@@ -26,5 +31,5 @@ const int eeaddr_version = 0;
 const int eeaddr_config = 1;
 const int eeaddr_top = eeaddr_config + sizeof(EEData);
 
-const int CURRENT_DATA_VERSION = 1;
+const int CURRENT_DATA_VERSION = 8;
 
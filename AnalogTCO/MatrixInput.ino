@@ -2,19 +2,87 @@ const boolean debugKeyInput = false;
 const boolean debugKeyFn = true;
 const boolean debugKeySearch = false;
 
-static_assert(inputColumns % 8 == 0, "Number of output columns must be a multiply of 8");
-static_assert((sizeof(unsigned int) * 8) >= inputColumns, "Max 16 columns is supported");
-static_assert(maxTarget <= 16, "KeySpec structure can record just 16 targets, sorry");
+static_assert(inputColumns % 8 == 0, "Number of input columns must be a multiply of 8");
+static_assert(inputColumns <= 64, "KeySpec structure can record just 64 columns, sorry");
+static_assert(maxTarget <= addressGroupBase, "Targets must not overlap group addresses");
 
 KeySpec   (&keyTranslations)[maxKeyTranslations] = eeData.keyTranslations;
 
 // the acknowledged, debounced state
 byte inputDebounced[inputByteSize];
+byte inputGatewayDirty[gatewayDirtyBytes(inputByteSize)];
+
+/**
+ * Rychle klavesy: stisk po klidu se prijme hned pri prvni hrane, bez cekani na debounce. Cisty prechod kontaktu
+ * z ustaleneho stavu nemuze byt falesny stisk; zakmity po stisku pohlti debouncer (uvolneni musi byt stabilni), 
+ * uvolneni se debouncuje normalne. Po uvolneni rychle klavesy se dalsi stisk po dobu 1-2 tiku debounceru 
+ * (`keyLockout`) zpracuje normalne, aby se zakmit pri uvolneni nepovazoval za novy stisk.
+ */
+byte (&keyFast)[inputByteSize] = eeData.keyFast;
+
+byte keyLockout[inputByteSize];
+byte keyLockoutOld[inputByteSize];
+
+/**
+ * Zpozdeni mezi prvni hranou stisku a zarazenim packetu do fronty, mikrosekundy. [0] = normalni, [1] = rychle klavesy.
+ */
+struct KeyLatency {
+  unsigned int  count;
+  unsigned long min;
+  unsigned long max;
+  unsigned long sum;
+};
+
+KeyLatency keyLatency[2];
+
+/**
+ * Posledni stisknuta klavesa (-1 = zadna) a cas jeji prvni hrany. Stisk nastal nekdy po predchozim cteni matice,
+ * ktere klavesu videlo uvolnenou; zpozdeni se proto meri od zacatku predchoziho cteni (horni mez vcetne periody cteni).
+ */
+int keyEdgeNumber = -1;
+unsigned long keyEdgeMicros;
+
+/**
+ * Zacatek tohoto a predchoziho cteni matice, micros()
+ */
+unsigned long keyScanStart;
+unsigned long keyPrevScanStart;
+
+/**
+ * Mereni, ktere jeste neskoncilo, kdyz se stiskla dalsi klavesa, se zahodi, po teto dobe [us] uz se povazuje za ztracene
+ */
+const unsigned long keyEdgeWindow = 200000UL;
+
+/**
+ * Zahozena mereni (prekryvajici se stisky)
+ */
+unsigned int keyLatencyDropped;
+
+/**
+ * Doba cteni cele matice klaves (vsechny radky), mikrosekundy
+ */
+unsigned long keyScanMicros;
+
+/**
+ * Cas posledni zmeny na klavesnici, `currentMillis`; 16bitovy cas by po 65 s klidu pretekl
+ */
+unsigned long keyActiveTime;
+
+/**
+ * Port a maska hodin a dat posuvneho registru, pro rychle cteni
+ */
+volatile uint8_t* inputClockPort;
+byte inputClockMask;
+volatile uint8_t* inputDataPort;
+byte inputDataMask;
 
 class KeyDebouncer : public Debouncer {
   public:
   KeyDebouncer(byte modCount, byte* debouncedState);
-  virtual boolean stableChange(byte number, boolean nState);
+  virtual boolean stableChange(int number, boolean nState);
+
+  protected:
+  virtual void reportByteChange(byte n8, byte state, byte mask);
 };
 
 KeyDebouncer::KeyDebouncer(byte modCount, byte* debouncedState) : Debouncer(modCount, debouncedState) {
@@ -22,30 +90,38 @@ KeyDebouncer::KeyDebouncer(byte modCount, byte* debouncedState) : Debouncer(modC
 
 KeyDebouncer inputKeyDebouncer(sizeof(inputDebounced), inputDebounced);
 
-unsigned int inputRowValue;
-unsigned int inputRowMask;
-
 void setupInputPorts() {
   pinMode(TcInputClock, OUTPUT);
   pinMode(TcInputData, INPUT);
   pinMode(TcInputLatch, OUTPUT);
+  inputClockPort = portOutputRegister(digitalPinToPort(TcInputClock));
+  inputClockMask = digitalPinToBitMask(TcInputClock);
+  inputDataPort = portInputRegister(digitalPinToPort(TcInputData));
+  inputDataMask = digitalPinToBitMask(TcInputData);
   resetInput();
+  registerGatewaySource(gatewayKeys, inputDebounced, inputByteSize, inputGatewayDirty);
 
   registerLineCommand("KMAP", &commandMapKeys);
   registerLineCommand("KEYS", &commandShowKeys);
   registerLineCommand("DMAP", &commandDelMap);
   registerLineCommand("PRES", &commandPress);
+  registerLineCommand("FAST", &commandFastKeys);
+  registerLineCommand("KLAT", &commandKeyLatency);
 }
 
 void resetInput() {
   for (byte i = 0; i < inputByteSize; i++) {
     inputDebounced[i] = 0;
   }
+  memset(keyLockout, 0, sizeof(keyLockout));
+  memset(keyLockoutOld, 0, sizeof(keyLockoutOld));
+  memset(keyLatency, 0, sizeof(keyLatency));
+  keyLatencyDropped = 0;
   memset(keyTranslations, 0, sizeof(keyTranslations));
   // zadefinujeme pocatecni nastaveni - vsechna tlacitka se posilaji na
   // jedno zarizeni.
   KeySpec &sp = keyTranslations[0];
-  sp.rectangle(0, 0, 7, 15, 2, 0);
+  sp.rectangle(0, 0, inputColumns - 1, inputRows - 1, 2, 0);
 }
 
 uint8_t analogShiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder) {
@@ -63,24 +139,72 @@ uint8_t analogShiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder) {
   return value;
 }
 
+/**
+ * Jako shiftIn(), ale primo pres registry portu; digitalWrite / digitalRead trvaji nekolik us.
+ */
+uint8_t fastShiftIn() {
+  uint8_t value = 0;
+  for (uint8_t m = 1; m != 0; m <<= 1) {
+    *inputClockPort |= inputClockMask;
+    if (*inputDataPort & inputDataMask) {
+      value |= m;
+    }
+    *inputClockPort &= ~inputClockMask;
+  }
+  return value;
+}
+
 unsigned int lastDebounceTick = 0;
 
+/**
+ * Vola se na zacatku cteni cele klavesnice
+ */
+void startKeyScan(unsigned long t) {
+  keyPrevScanStart = keyScanStart;
+  keyScanStart = t;
+}
+
+boolean isKeyboardIdle() {
+  return (currentMillis - keyActiveTime) >= keyIdleTime;
+}
+
+/**
+ * Vola se po precteni cele klavesnice
+ */
+void tickInputDebouncer(unsigned long scanMicros) {
+  keyScanMicros = scanMicros;
+  if (elapsedTime(lastDebounceTick, keyboardDebounceTime)) {
+    inputKeyDebouncer.tick();
+    memcpy(keyLockoutOld, keyLockout, sizeof(keyLockout));
+    memset(keyLockout, 0, sizeof(keyLockout));
+  }
+}
+
+/**
+ * Precte radek ze vsech zretezenych registru; prvni precteny byte jsou sloupce 1-8.
+ */
 void processInputRow() {
+  byte row[inputRowSize];
   digitalWrite(TcInputClock, LOW);
   digitalWrite(TcInputLatch, HIGH);
 //  delayMicroseconds(10);
   digitalWrite(TcInputClock, HIGH);
 //  delayMicroseconds(10);
   digitalWrite(TcInputLatch, LOW);
-  byte input1 = TcInputData > 13 ? analogShiftIn(TcInputData, TcInputClock, LOW) : shiftIn(TcInputData, TcInputClock, LOW);
-  input1 = ~input1;
-  inputKeyDebouncer.debounce(ioRowIndex, &input1, 1);
-  if (elapsedTime(lastDebounceTick, keyboardDebounceTime)) {
-    inputKeyDebouncer.tick();
+  byte adc = ADCSRA;
+  if (TcInputData > 13) {
+    // ADC s delickou 16 misto 128: prevod cca 15us, presnost staci na rozliseni TTL urovni; ostatni analogRead zustanou s puvodni delickou
+    ADCSRA = (adc & ~0x07) | 0x04;
+  }
+  for (byte i = 0; i < inputRowSize; i++) {
+    byte input1 = TcInputData > 13 ? analogShiftIn(TcInputData, TcInputClock, LOW) : fastShiftIn();
+    row[i] = ~input1;
   }
+  ADCSRA = adc;
+  inputKeyDebouncer.debounce(ioRowIndex * inputRowSize, row, inputRowSize);
 }
 
-int findKeyTranslation(byte nx, byte ny, int& target) {
+int findKeyTranslation(byte nx, byte ny, const KeySpec*& found) {
   if (debugKeySearch) {
     Serial.print(F("Search: ")); Serial.print(ny); Serial.print(','); Serial.println(nx);
   }
@@ -88,16 +212,23 @@ int findKeyTranslation(byte nx, byte ny, int& target) {
     if (debugKeySearch) {
       Serial.print(F("Trying: ")); spec->printDef(); Serial.println();
     }
-    if (spec->matrix) {
-      if ((spec->x > nx) || (spec->y > ny)) {
-        if (debugKeySearch) {
-          Serial.println(F("Start too high"));
-        }
+    if (!spec->matrix) {
+      // usek: klavesy po radcich od x,y
+      int r = (ny * inputColumnsRounded + nx) - (spec->y * inputColumnsRounded + spec->x);
+      if ((r < 0) || (r >= spec->lenOrMatrix)) {
         continue;
       }
+      found = spec;
+      return r + spec->commandBase;
+    }
+    if ((spec->x > nx) || (spec->y > ny)) {
+      if (debugKeySearch) {
+        Serial.println(F("Start too high"));
+      }
+      continue;
     }
-    byte w = (spec->lenOrMatrix & 0xf) + 1;
-    byte h = (spec->lenOrMatrix >> 4) + 1;
+    byte w = spec->width();
+    byte h = spec->height();
 
     byte mx = spec->x + w;
     byte my = spec->y + h;
@@ -116,13 +247,13 @@ int findKeyTranslation(byte nx, byte ny, int& target) {
     byte dx = (nx - spec->x);
     byte dy = (ny - spec->y);
     
-    byte r = fx * dy + dx;
-    target = spec->target;
-    byte cmd = r + spec->commandBase;
+    int r = fx * dy + dx;
+    found = spec;
+    int cmd = r + spec->commandBase;
     if (debugKeySearch) {
       Serial.print(F("dx: ")); Serial.print(dx); Serial.print(F("\tdy: ")); Serial.print(dy); 
       Serial.print(F("\tline size: ")); Serial.print(fx); Serial.print(F("\toffset: ")); Serial.println(r); 
-      Serial.print(F("target: ")); Serial.print(target); Serial.print(F("\tcmd: ")); Serial.println(cmd); 
+      Serial.print(F("target: ")); Serial.print(spec->target); Serial.print(F("\tcmd: ")); Serial.println(cmd); 
     }
     return cmd;
   }
@@ -131,10 +262,11 @@ int findKeyTranslation(byte nx, byte ny, int& target) {
 
 long sensTime = millis() + 500;
 
-boolean KeyDebouncer::stableChange(byte number, boolean nState) {
+boolean KeyDebouncer::stableChange(int number, boolean nState) {
   if (!Debouncer::stableChange(number, nState)) {
     return false;
   }
+  gatewayChanged(gatewayKeys, number >> 3);
   byte ny = number / inputColumnsRounded;
   byte nx = number - (ny * inputColumnsRounded);
 
@@ -143,16 +275,68 @@ boolean KeyDebouncer::stableChange(byte number, boolean nState) {
   }
 
   if (currentMillis < sensTime) {
-    return;
+    return false;
   }
 
   pressKey(nx, ny, nState);
+  if (nState && (number == keyEdgeNumber)) {
+    recordKeyLatency(readBit(keyFast, number), micros() - keyEdgeMicros);
+    keyEdgeNumber = -1;
+  }
+  if (!nState && readBit(keyFast, number)) {
+    writeBit(keyLockout, number, 1);
+  }
   return true;
 }
 
+void KeyDebouncer::reportByteChange(byte n8, byte state, byte mask) {
+  if (mask != 0) {
+    keyActiveTime = currentMillis;
+  }
+  // stisky klaves, ktere byly v klidu
+  byte pressed = mask & state & ~inputDebounced[n8];
+  byte fast = pressed & keyFast[n8] & ~(keyLockout[n8] | keyLockoutOld[n8]);
+  int n = n8 << 3;
+  for (byte m = 1; m != 0; m <<= 1, n++) {
+    if (!(pressed & m)) {
+      continue;
+    }
+    if (isPending(n)) {
+      fast &= ~m;
+      continue;
+    }
+    if ((keyEdgeNumber >= 0) && (keyEdgeNumber != n) && (keyScanStart - keyEdgeMicros < keyEdgeWindow)) {
+      // dva stisky soucasne: nevi se, ke kteremu patri ktery cas
+      keyEdgeNumber = -1;
+      keyLatencyDropped++;
+      continue;
+    }
+    keyEdgeNumber = n;
+    keyEdgeMicros = keyPrevScanStart;
+  }
+  Debouncer::reportByteChange(n8, state, mask);
+  n = n8 << 3;
+  for (byte m = 1; fast != 0; m <<= 1, n++) {
+    if (fast & m) {
+      fast &= ~m;
+      stableChange(n, true);
+    }
+  }
+}
+
+void recordKeyLatency(boolean fast, unsigned long d) {
+  KeyLatency& l = keyLatency[fast ? 1 : 0];
+  if ((l.count == 0) || (d < l.min)) {
+    l.min = d;
+  }
+  l.max = max(l.max, d);
+  l.sum += d;
+  l.count++;
+}
+
 void pressKey(byte nx, byte ny, boolean nState) {
-  int target = 0;
-  int command = findKeyTranslation(nx, ny, target);
+  const KeySpec* spec;
+  int command = findKeyTranslation(nx, ny, spec);
 
   if (command == -1) {
     Serial.print(F("Unhandled key: ")); Serial.print(nx); Serial.print(','); Serial.println(ny);
@@ -160,11 +344,17 @@ void pressKey(byte nx, byte ny, boolean nState) {
   }
   if (debugKeyFn) {
     Serial.print(F("Key ")); Serial.print(nx); Serial.print(','); Serial.print(ny); Serial.print(F(" => "));
-    Serial.print(target); Serial.print(':'); Serial.println(command);
+    Serial.print(spec->target); Serial.print(':'); Serial.println(command);
+  }
+  byte msg[sizeof(RemoteCommand)];
+  byte len = encodeKeyCommand(msg, command, nState);
+  if (len == 0) {
+    Serial.print(F("Command too large: ")); Serial.println(command);
+    return;
   }
-  RemoteCommand cmd(1, command, nState);
 
-  addMessage(target, eeData.busId, (const byte*)&cmd, sizeof(cmd));
+  // prepinac posila stav, novejsi stav nahradi neodeslany starsi
+  addMessage(spec->target, eeData.busId, msg, len, spec->priority, 0, spec->latch);
 }
 
 void commandMapKeys() {
@@ -269,28 +459,49 @@ void commandMapKeys() {
     }
     h--;
     w--;
-    lengthOrMatrix = ((h & 0x0f) << 4) | w;
+    lengthOrMatrix = (h << 6) | w;
     inputPos = colon + 1;
   } else {
     lengthOrMatrix = nextNumber();
-    if (lengthOrMatrix < 1) {
+    if ((lengthOrMatrix < 1) || (y * inputColumnsRounded + x + lengthOrMatrix > inputRows * inputColumnsRounded)) {
       Serial.println(F("Bad length"));
       return;
     }
   }
 
   int target = nextNumber();
-  if ((target < 1) || (target == eeData.busId) || (target >= maxTarget)) {
+  if ((target < 1) || (target == eeData.busId) || ((target >= maxTarget) && !isGroup(target))) {
     Serial.println(F("Invalid target"));
     return;
   }
 
   int cmdBase = nextNumber();
-  if (cmdBase < 0) {
+  if ((cmdBase < 0) || (cmdBase > 0xff)) {
     Serial.println(F("Invalid command base"));
     Serial.print(target); Serial.print(' '); Serial.print(cmdBase);
     return;
   }
+  // prikaz se posila v jednom byte
+  int keyCount = matrix ? ((lengthOrMatrix >> 6) + 1) * ((lengthOrMatrix & 0x3f) + 1) : lengthOrMatrix;
+  if (cmdBase + keyCount - 1 > 0xff) {
+    Serial.println(F("Commands over 255"));
+    return;
+  }
+
+  int prio = nextNumber();
+  if (prio == -2) {
+    prio = prioNormal;
+  } else if ((prio < prioLow) || (prio > prioUrgent)) {
+    Serial.println(F("Bad priority"));
+    return;
+  }
+  int latch = nextNumber();
+  if (latch == -2) {
+    latch = 0;
+  } else if ((latch < 0) || (latch > 1)) {
+    Serial.println(F("Bad switch flag"));
+    return;
+  }
 
   KeySpec *pos = freeSlot;
   KeySpec spec;
@@ -299,6 +510,8 @@ void commandMapKeys() {
   spec.lenOrMatrix = lengthOrMatrix;
   spec.target = target;
   spec.commandBase = cmdBase;
+  spec.priority = prio;
+  spec.latch = latch;
   if ((index > -1) && (index < slotCnt)) {
     pos = keyTranslations + index;
     memmove(pos + 1, pos, (freeSlot - pos) * sizeof(KeySpec));
@@ -356,14 +569,18 @@ void KeySpec::printDef() {
   Serial.print(matrix ? 'm' : 's'); Serial.print(':');
   Serial.print(y + 1); Serial.print(','); Serial.print(x + 1); Serial.print(':');
   if (matrix) {
-    int w = ((lenOrMatrix & 0x0f) + 1);
-    int h = ((lenOrMatrix >> 4) + 1);
-    Serial.print(h); Serial.print(','); Serial.print(w);
+    Serial.print(height()); Serial.print(','); Serial.print(width());
   } else {
     Serial.print(lenOrMatrix);
   }
   Serial.print(':');
   Serial.print(target); Serial.print(':'); Serial.print(commandBase);
+  if ((priority != prioNormal) || latch) {
+    Serial.print(':'); Serial.print(priority);
+  }
+  if (latch) {
+    Serial.print(F(":1"));
+  }
 }
 
 void commandPress() {
@@ -409,3 +626,106 @@ void commandPress() {
   pressKey(x, y, on);
 }
 
+
+/**
+ * Cislo klavesy z "radek,sloupec", nebo -1
+ */
+int parseKeyPoint() {
+  char *dot = strchr(inputPos, ',');
+  if (dot == NULL) {
+    Serial.println(F("Bad point"));
+    return -1;
+  }
+  *dot = 0;
+  int y = nextNumber();
+  inputPos = dot + 1;
+  int x = nextNumber();
+  if ((x < 1) || (x > inputColumns)) {
+    Serial.println(F("Bad column"));
+    return -1;
+  }
+  if ((y < 1) || (y > inputRows)) {
+    Serial.println(F("Bad row"));
+    return -1;
+  }
+  return (y - 1) * inputColumnsRounded + (x - 1);
+}
+
+void dumpFastKeys() {
+  int n = 0;
+  while (n < inputRows * inputColumnsRounded) {
+    if (!readBit(keyFast, n)) {
+      n++;
+      continue;
+    }
+    int s = n;
+    while ((n < inputRows * inputColumnsRounded) && readBit(keyFast, n)) {
+      n++;
+    }
+    Serial.print(F("FAST:")); Serial.print(s / inputColumnsRounded + 1); Serial.print(','); Serial.print(s % inputColumnsRounded + 1);
+    Serial.print(':'); Serial.println(n - s);
+  }
+}
+
+/**
+ * FAST:radek,sloupec:pocet[:0] zapne (0 = vypne) rychlou odezvu stisku pro `pocet` klaves od dane pozice,
+ * klavesy se pocitaji po radcich jako u KMAP:s. FAST vypise nastaveni.
+ */
+void commandFastKeys() {
+  if (*inputPos == 0) {
+    dumpFastKeys();
+    return;
+  }
+  char *colon = strchr(inputPos, ':');
+  if (colon == NULL) {
+    Serial.println(F("Bad definition"));
+    return;
+  }
+  *colon = 0;
+  int s = parseKeyPoint();
+  if (s < 0) {
+    return;
+  }
+  inputPos = colon + 1;
+  int cnt = nextNumber();
+  if ((cnt < 1) || (s + cnt > inputRows * inputColumnsRounded)) {
+    Serial.println(F("Bad length"));
+    return;
+  }
+  int on = nextNumber();
+  if (on == -2) {
+    on = 1;
+  } else if ((on < 0) || (on > 1)) {
+    Serial.println(F("Bad flag"));
+    return;
+  }
+  for (int n = s; n < s + cnt; n++) {
+    writeBit(keyFast, n, on);
+  }
+  dumpFastKeys();
+}
+
+/**
+ * KLAT vypise zpozdeni stisk -> packet ve fronte (us):
+ *    KLAT:n|f:pocet:min:prumer:max
+ *    KLAT:scan:doba cteni matice (us):perioda cteni (ms):zahozena mereni
+ * zpozdeni se meri od predchoziho cteni matice, ktere klavesu videlo uvolnenou, tedy vcetne periody cteni. Mereni prekryte
+ * stiskem jine klavesy se zahodi.
+ * KLAT:c statistiku vynuluje.
+ */
+void commandKeyLatency() {
+  if (*inputPos == 'c') {
+    memset(keyLatency, 0, sizeof(keyLatency));
+    keyLatencyDropped = 0;
+    Serial.println(F("Cleared"));
+    return;
+  }
+  for (byte i = 0; i < 2; i++) {
+    const KeyLatency& l = keyLatency[i];
+    Serial.print(F("KLAT:")); Serial.print(i ? 'f' : 'n'); Serial.print(':');
+    Serial.print(l.count); Serial.print(':'); Serial.print(l.min); Serial.print(':');
+    Serial.print(l.count ? l.sum / l.count : 0); Serial.print(':'); Serial.println(l.max);
+  }
+  Serial.print(F("KLAT:scan:")); Serial.print(keyScanMicros); Serial.print(':');
+  Serial.print(isKeyboardIdle() ? keyIdleScanPeriod : keyScanPeriod); Serial.print(':'); Serial.println(keyLatencyDropped);
+}
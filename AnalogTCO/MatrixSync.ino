@@ -0,0 +1,144 @@
+/**
+ * Resynchronizace stavu klaves do slave. Bezne se posilaji jen zmeny (`pressKey`), slave, ktery se restartuje nebo prijde o packet,
+ * by tak mel jiny stav prepinacu nez pult, dokud nekdo prepinacem nepohne.
+ *
+ * Pro kazdy cil se z prekladove tabulky klaves sestavi bitove pole aktualniho stavu (`inputDebounced`) vsech prikazu, ktere na cil vedou,
+ * a posle se jednim, nejvyse nekolika packety:
+ *    [opKeySnapshot] [prvni prikaz] [bity prikazu ...]
+ * bit 0 prvniho byte odpovida prvnimu prikazu. Stav se posila po startu (po uplynuti `sensTime`), kdyz se slave opet ozve (`onSlaveUp`)
+ * a na prikaz SYNC.
+ *
+ * Packet ma prioritu `prioUrgent`, aby se vyslal drive nez pozdeji zarazene zmeny klaves; jinak by slave mohl dostat starsi stav
+ * az po novejsi zmene. Dosud neodeslany starsi stav pro stejny cil nahradi novy.
+ */
+
+const boolean debugKeySync = false;
+
+/**
+ * Max delka dat v packetu, ktery jeste prijme slave s bufferem `recvBufferSize`
+ */
+const byte keySyncPayload = recvBufferSize - (sizeof(len_t) + 2 * sizeof(address_t));
+
+/**
+ * Pocet prikazu v jednom packetu; pro skupinu o masku clenu (`groupHeaderSize`) mene
+ */
+const byte keySyncBits = (keySyncPayload - 2) * 8;
+
+const byte keySyncTargets = addressGroupBase + maxBusGroups;
+
+/**
+ * Cile, kterym se ma poslat stav klaves
+ */
+byte keySyncPending[(keySyncTargets + 7) / 8];
+
+void setupKeySync() {
+  registerLineCommand("SYNC", &commandKeySync);
+  // po startu vsem
+  memset(keySyncPending, 0xff, sizeof(keySyncPending));
+}
+
+void requestKeySync(byte target) {
+  if (target < keySyncTargets) {
+    writeBit(keySyncPending, target, 1);
+  }
+}
+
+/**
+ * Slave se opet ozval; posle se mu stav klaves, i klaves mapovanych na skupiny, kterych je clenem.
+ */
+void onSlaveUp(byte t) {
+  requestKeySync(t);
+  for (byte g = 0; g < maxBusGroups; g++) {
+    if (busGroups[g] & (1U << t)) {
+      requestKeySync(addressGroupBase + g);
+    }
+  }
+}
+
+/**
+ * Zpetne hlaseni slave se zmenilo. TCO nema vystupy, stav je v tabulce (FBK) a jde do PC pres USB branu.
+ */
+void onSlaveFeedback(byte t, byte n, boolean state) {
+  gatewayChanged(gatewayFeedback, t * feedbackSlaveBytes + (n >> 3));
+  if (debugKeySync) {
+    Serial.print(F("Feedback ")); Serial.print(t); Serial.print(':'); Serial.print(n + 1); Serial.print('='); Serial.println(state);
+  }
+}
+
+/**
+ * Vola se z loop(). V jednom pruchodu posle stav nejvyse jednomu cili.
+ */
+void processKeySync() {
+  if (currentMillis < sensTime) {
+    return;
+  }
+  for (byte t = 1; t < keySyncTargets; t++) {
+    if (readBit(keySyncPending, t)) {
+      writeBit(keySyncPending, t, 0);
+      sendKeySync(t);
+      return;
+    }
+  }
+}
+
+/**
+ * Prikaz klavesy `n` pro cil `target`, nebo -1
+ */
+int keyCommandFor(int n, byte target) {
+  const KeySpec* spec;
+  byte ny = n / inputColumnsRounded;
+  int cmd = findKeyTranslation(n - (ny * inputColumnsRounded), ny, spec);
+  if ((cmd < 0) || (spec->target != target)) {
+    return -1;
+  }
+  return cmd;
+}
+
+void sendKeySync(byte target) {
+  int first = 0x100;
+  int last = -1;
+  for (int n = 0; n < inputRows * inputColumnsRounded; n++) {
+    int cmd = keyCommandFor(n, target);
+    if (cmd >= 0) {
+      first = min(first, cmd);
+      last = max(last, cmd);
+    }
+  }
+  if (last < 0) {
+    return;
+  }
+  int chunkBits = isGroup(target) ? keySyncBits - groupHeaderSize * 8 : keySyncBits;
+  for (int base = first; base <= last; base += chunkBits) {
+    byte msg[keySyncPayload];
+    byte cnt = min(last - base + 1, chunkBits);
+    memset(msg, 0, sizeof(msg));
+    msg[0] = opKeySnapshot;
+    msg[1] = base;
+    for (int n = 0; n < inputRows * inputColumnsRounded; n++) {
+      int cmd = keyCommandFor(n, target) - base;
+      if ((cmd >= 0) && (cmd < cnt) && readBit(inputDebounced, n)) {
+        writeBit(msg + 2, cmd, 1);
+      }
+    }
+    addMessage(target, eeData.busId, msg, 2 + (cnt + 7) / 8, prioUrgent, 0, true);
+    if (debugKeySync) {
+      Serial.print(F("Key sync ")); Serial.print(target); Serial.print(':'); Serial.print(base); Serial.print('+'); Serial.println(cnt);
+    }
+  }
+}
+
+/**
+ * SYNC posle stav klaves vsem cilum, SYNC:cil jen jednomu.
+ */
+void commandKeySync() {
+  int t = nextNumber();
+  if (t == -2) {
+    memset(keySyncPending, 0xff, sizeof(keySyncPending));
+  } else if ((t < 1) || (t >= keySyncTargets)) {
+    Serial.println(F("Invalid target"));
+    return;
+  } else {
+    requestKeySync(t);
+  }
+  Serial.println(F("Sync requested"));
+}
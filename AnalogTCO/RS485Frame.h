@@ -8,6 +8,16 @@
  */
 // const int recvBufferSize = 20;
 
+/**
+ * Velikost kruhoveho bufferu pro byte prijate v preruseni; mocnina 2.
+ */
+const byte recvRingSize = 32;
+
+/**
+ * Pocet slotu pro prijate ramce, ktere jeste nezpracovala hlavni smycka.
+ */
+const byte recvSlotCount = 3;
+
 /**
  * Kolik ms po zacatku prijmu muze prijit start byte. 
  */
@@ -21,6 +31,11 @@ const int recvDelayBetweenPacketBytes = 8;
 typedef uint8_t address_t;
 typedef uint8_t len_t;
 
+/**
+ * Pocet byte CommFrame pred vlastnim ramcem (retryCount..., deadline). Nevysilaji se, pouziva je fronta BusMasteru.
+ */
+const byte frameQueueHeader = 2;
+
 /**
  * Struktura packetu. 
  */
@@ -28,7 +43,23 @@ struct CommFrame {
   /**
    * Pouzito ve vyssi vrstve. Je to neciste, ale napsat to "spravne" je slozitejsi.
    */
-  byte  retryCount;
+  byte  retryCount : 4;
+  /**
+   * Trida priority, BusPriority
+   */
+  byte  priority : 2;
+  /**
+   * Novejsi packet pro stejny cil a prikaz (prvni 2 byte dat) nahradi tento, dokud neni odeslan.
+   */
+  byte  supersede : 1;
+  /**
+   * Plati `deadline`
+   */
+  byte  hasDeadline : 1;
+  /**
+   * Cas, po kterem se packet zahodi; jednotky `deadlineTick` ms, spodnich 8 bitu.
+   */
+  byte  deadline;
   /**
    * Delka vlastnich dat.
    */
@@ -46,8 +77,8 @@ struct CommFrame {
    */
   byte  dataStart;
 
-  CommFrame() : from(0), to(0), len(1), retryCount(0) {}
-  CommFrame(address_t af, address_t at, byte l) : from(af), to(at), len(l), retryCount(0) {}
+  CommFrame() : from(0), to(0), len(1), retryCount(0), priority(prioNormal), supersede(0), hasDeadline(0) {}
+  CommFrame(address_t af, address_t at, byte l) : from(af), to(at), len(l), retryCount(0), priority(prioNormal), supersede(0), hasDeadline(0) {}
 
   const byte* data() const {
     return &dataStart;
@@ -64,11 +95,11 @@ struct CommFrame {
    * Kolik byte se ma preskocit v bufferu. Zahrnuje ta
    */
   static byte skipSize(len_t payloadLen) {
-    return frameSize(payloadLen) + sizeof(byte /* retrycount */);
+    return frameSize(payloadLen) + frameQueueHeader;
   }
 
   byte bufferSize() {
-    return frameSize() + sizeof(byte /* retrycount */);
+    return frameSize() + frameQueueHeader;
   }
 
   byte frameSize() {
@@ -89,9 +120,15 @@ struct CommFrame {
 };
 
 boolean isBroadcast(address_t add) {
-  return add == (1 << (sizeof(address_t))) - 1;
+  return add == addressBroadcast;
 }
 
+boolean isGroup(address_t add) {
+  return (add >= addressGroupBase) && (add < addressGroupBase + maxBusGroups);
+}
+
+static_assert(offsetof(CommFrame, len) == frameQueueHeader, "Queue header size mismatch");
+
 #ifdef USE_CRC
 #include <util/crc16.h>
 #define CRC_INIT_VAL 0xffff
@@ -122,6 +159,10 @@ boolean verifyChecksum(checksum_t expected, checksum_t got) {
 #endif
 
 extern checksum_t recvChecksum;
+extern volatile unsigned int recvRingOverruns;
+extern unsigned int recvSlotDrops;
+extern unsigned int busActivityTime;
+extern unsigned int recvByteCount;
 const int checksumSize = sizeof(checksum_t);
 
 enum ReceiveError {
@@ -130,7 +171,8 @@ enum ReceiveError {
   errLong,
   errTimeout,
   errUnexpected,
-  errTimeoutStart
+  errTimeoutStart,
+  errOverrun
 };
 
 
@@ -1,5 +1,5 @@
 /**
- * Vysilac - prijimac packetu po RS485. Vysilac odesila packety se strukturou CommFrame (bez prvniho byte - retryCount).
+ * Vysilac - prijimac packetu po RS485. Vysilac odesila packety se strukturou CommFrame (bez hlavicky fronty - retryCount atd).
  * Packet se vysila ve tvaru:
  * <start byte> <delka> <cil> <zdroj> <data....> <kontrolni soucet>
  * 
@@ -9,15 +9,22 @@
  * Aby se start byte nevyskytl nikde jinde, je jakykoliv vyskyt hodnoty `escapeChar` - `escapeTop` preveden na dvojici <escapeChar> <data ^ escapechar>. Tim se zajisti,
  * ze se hodnoty 0x7d-0x7f nevyskytuji NIKDE nez na definovanych mistech.
  * 
+ * Rozumi-li tomu cil (`fold` u `transmitFrame`), nese byte delky ve hornich 3 bitech i prvni byte dat (obvykle kod operace), je-li mensi nez 7: <(prvni + 1) << 5 | (delka - 1)>, prvni byte dat
+ * se pak nevysila (viz `wireLenByte`). Horni bity 0 znamenaji obycejnou delku (max 31). Hodnoty 0x7d-0x7f se takto nekoduji, byte delky se tedy nikdy
+ * neescapuje.
+ * 
  * Kontrolni soucet se pocita jako jednoduchy XOR vsech vyslanych byte, tedy i start byte, adresnich hlavicek, delky ... a pote se slozi (XOR) s kontrolnim souctem a 
  * vysledkem je, pri neporusenych datech, 0.
  * 
- * Modul registruje rutinu preruseni isrReceiveData. Z preruseni pak vola 
- *        void onReceiveData(const CommFrame&);
- * v pripade prijeti spravneho ramce (zkontrolovaly kontrolni soucet), nebo
+ * Modul registruje rutinu preruseni isrReceiveData, ktera jen ulozi prijaty byte do kruhoveho bufferu `recvRing`. Ramce z nej sklada (start byte, escape,
+ * kontrolni soucet) az `periodicReceiveCheck` v hlavni smycce, do jednoho z `recvSlotCount` slotu. Spravny ramec si prevezme volajici:
+ *        const CommFrame* receivedFrame();
+ * vrati nejstarsi prijaty ramec (nebo NULL); slot patri volajicimu, dokud jej neuvolni
+ *        void releaseReceivedFrame();
+ * Neni-li volny slot, ramec se zahodi a ohlasi se chyba `errOverrun`. Pri chybe se vola
  *        void onReceiveError(int errCode);
- * pokud dojde k chybe. POZOR - mohou se vyvolat i zcela nezavisle, kdykoliv je transceiver zapnuty na prijem a prijdou data ! Data je nutne ihned okopirovat, misto bude
- * pouzito pro prijem dalsich byte. Ve chvili kdy interrupt funkce zaregistruje data, prepne se modul do rezimu cteni (isReceiving() == true); snazi se chytit na start byte.
+ * POZOR - chyba muze prijit i zcela nezavisle, kdykoliv je transceiver zapnuty na prijem a prijdou data. Ve chvili kdy prijimac zpracuje data, prepne se modul
+ * do rezimu cteni (isReceiving() == true); snazi se chytit na start byte.
  * 
  * Pri vysilani je NUTNE periodicky volat 
  *  byte transmitSingle()
@@ -27,9 +34,8 @@
  * u prijimace: bude-li prodleva mezi byte prilis velka, packet zahodi. Pri vysilani rychlosti 9600 baud trva odeslani jednoho byte cca 10 * 1/9600 = 1ms, tedy vyvolani
  * transmitSingle() [spolecne s pripadnym esc] trva max 2ms. Odeslani minimalne velkeho ramce pak trva 6-10ms (velmi nepravdepodobny pripad, kde je vsude esc).
  * 
- * Prijimaci cast v preruseni strada data do prijmoveho bufferu, ktery po dokonceni byte oznami "callback" funkci `onReceiveData`. NENI ZARUCENO ze po navratu z `onReceiveData` 
- * se do bufferu opet nezacne zapisovat (dalsi prijimana data). `onReceiveData` a `onReceiveError` mohou bezet v kontextu preruseni, vsechny promenne se kterymi pracuji
- * musi byt `volatile`.
+ * V preruseni se tedy nic nedekoduje a nic se nevypisuje; dokud se kruhovy buffer nezaplni, neztrati se zadny byte, i kdyz je hlavni smycka chvili zamestnana.
+ * Ramce dekodovane behem jednoho `periodicReceiveCheck` (napr. ACK vice clenu skupiny) zustanou ve slotech, dokud je volajici nevyzvedne.
  */
 
 const boolean debug485Frame = false;
@@ -52,15 +58,64 @@ const int escapeChar = 0x7d;
  */
 const int escapeTop = 0x7f;
 
+const byte lenFoldShift = 5;
+const byte lenFoldMask = 0x1f;
+/**
+ * Nejvetsi hodnota prvniho byte dat, ktera se vejde do byte delky
+ */
+const byte maxFoldedFirst = 6;
+
+static_assert(recvBufferSize <= lenFoldMask, "Plain length must not use the folded bits");
+
+static_assert((recvRingSize & (recvRingSize - 1)) == 0, "Ring size must be a power of 2");
+
+/**
+ * Syrova data z ISR. Zapisuje jen ISR (`recvRingHead`), cte jen hlavni smycka (`recvRingTail`).
+ */
+volatile byte recvRing[recvRingSize];
+volatile byte recvRingHead = 0;
+volatile byte recvRingTail = 0;
+
+/**
+ * Pocet byte ztracenych pri plnem `recvRing`
+ */
+volatile unsigned int recvRingOverruns = 0;
+
+/**
+ * Precte (a s `reset` vynuluje) `recvRingOverruns`. Zvysuje jej ISR a 16bitovy pristup neni na AVR atomicky, proto se zakazanym prerusenim.
+ */
+unsigned int readRingOverruns(boolean reset) {
+  noInterrupts();
+  unsigned int n = recvRingOverruns;
+  if (reset) {
+    recvRingOverruns = 0;
+  }
+  interrupts();
+  return n;
+}
+
+/**
+ * Sloty pro dekodovane ramce. Pouzivaji se jako fronta: `recvSlotFirst` je nejstarsi prijaty, za `recvSlotReady`
+ * prijatymi nasleduje slot, do ktereho se prave dekoduje.
+ */
+byte recvSlots[recvSlotCount][recvBufferSize + frameQueueHeader + 1];
+byte recvSlotFirst = 0;
+byte recvSlotReady = 0;
+
+/**
+ * Pocet ramcu zahozenych pro nedostatek slotu
+ */
+unsigned int recvSlotDrops = 0;
+
 /**
- * Buffer pro prijem dat z ISR
+ * Posledni byte na sbernici (prijaty nebo vlastni vyslany), pro detekci ticha
  */
-byte recvBuffer[recvBufferSize + 2];
+unsigned int busActivityTime = 0;
 
 /**
- * Konec bufferu pro prijem dat
+ * Pocet vsech prijatych byte (pro vytizeni sbernice), pretece
  */
-const byte* recvBufferLimit = recvBuffer + recvBufferSize;
+unsigned int recvByteCount = 0;
 
 #ifdef NEO
 NeoSWSerial commSerial( rs485Receive, rs485Send );
@@ -99,6 +154,23 @@ CommPhase xmitPhase2 = idle;
  */
 const byte *xmitPtr = NULL;
 
+/**
+ * Vysilany byte delky a pozice prvniho byte dat, ktery je v nem zakodovany (NULL = zadny)
+ */
+byte xmitLenByte;
+const byte *xmitFoldPtr = NULL;
+
+/**
+ * Byte delky na drate; je-li to mozne, obsahuje i prvni byte dat.
+ */
+byte wireLenByte(len_t len, byte first) {
+  if ((len == 0) || (len > lenFoldMask + 1) || (first > maxFoldedFirst)) {
+    return len;
+  }
+  byte b = ((first + 1) << lenFoldShift) | (len - 1);
+  return ((b >= escapeChar) && (b <= escapeTop)) ? len : b;
+}
+
 void setupRS485Ports() {
   pinMode(rs485Receive, INPUT);
   digitalWrite(rs485Send, HIGH);
@@ -111,12 +183,23 @@ void setupRS485Ports() {
   commSerial.begin(9600);
 }
 
-void transmitFrame(const CommFrame* p) {
+/**
+ * Zacne vysilat ramec; `fold` = cil rozumi slozenemu byte delky
+ */
+void transmitFrame(const CommFrame* p, boolean fold) {
   if (isTransmitting()) {
     return;
   }
   xmitPtr = &(p->len);
   xmitCounter = CommFrame::frameSize(p->len);
+  xmitLenByte = fold ? wireLenByte(p->len, p->dataStart) : p->len;
+  xmitFoldPtr = NULL;
+  if (xmitLenByte != p->len) {
+    xmitFoldPtr = &p->dataStart;
+    xmitCounter--;
+  }
+  // neprevzate ramce patri k predchozi vymene
+  recvSlotReady = 0;
   initChecksum(xmitXor);
   xmitPhase = startByte;
 
@@ -173,6 +256,9 @@ void stopTransmitter() {
   while (commSerial.available()) {
     commSerial.read();
   }
+  // vlastni echo nebo smeti z doby vysilani
+  recvRingTail = recvRingHead;
+  recordStartTime(busActivityTime);
 }
 
 /**
@@ -186,10 +272,18 @@ byte transmitSingle(boolean enableImmediateRead) {
   switch (xmitPhase) {
     case startByte:
       rs485SendRawByte(startByteChar);
+      xmitPhase = length;
+      return 0;
+    case length:
+      xmitOneByte(xmitLenByte);
+      xmitPtr++;
       xmitPhase = payload;
-      return;
+      break;
     case payload:
       xmitOneByte(*xmitPtr++);
+      if (xmitPtr == xmitFoldPtr) {
+        xmitPtr++;
+      }
       break;
     case checksum:
       if (debug485Frame) {
@@ -216,7 +310,13 @@ byte transmitSingle(boolean enableImmediateRead) {
 /**
  * Ukazatel na ukladana data
  */
-byte *recvPtr = recvBuffer;
+byte *recvPtr = NULL;
+
+/**
+ * Pozice a hodnota prvniho byte dat, ktery prisel v byte delky (NULL = zadny)
+ */
+byte *recvFoldPtr = NULL;
+byte recvFoldByte;
 
 /**
  * Pocitadlo byte k prijeti. Neobsahuje checksum, ale obsahuje delku.
@@ -236,7 +336,7 @@ checksum_t recvChecksum;
 /**
  * Faze prijmu
  */
-volatile CommPhase recvPhase = idle;
+CommPhase recvPhase = idle;
 
 /**
  * Docasna faze
@@ -253,12 +353,14 @@ int errorAtEnd = 0;
  * Cas posledniho prijmu (nebo zahajeni prijmu). Pouziva se pro detekci
  * prilis velke prodlevy mezi jednotlivymi byte nebo start byte.
  */
-volatile long lastReceiveMillis = 0;
+long lastReceiveMillis = 0;
 
 /**
- * Pomocny alias,
+ * Slot, do ktereho se dekoduje prave prijimany ramec
  */
-const CommFrame& recvFrame = *((CommFrame*)recvBuffer);
+CommFrame& recvFrame() {
+  return *((CommFrame*)recvSlots[(recvSlotFirst + recvSlotReady) % recvSlotCount]);
+}
 
 void initReceiver() {
   recvPhase = idle;
@@ -271,7 +373,6 @@ void startReceiver() {
   delayMicroseconds(50);
   digitalWrite(rs485Direction, LOW);
   recvPhase = startByte;
-  recvPtr = &recvFrame.len;
   lastReceiveMillis = currentMillis;
   errorAtEnd = 0;
 }
@@ -280,31 +381,69 @@ boolean isReceiving() {
   return recvPhase != idle;
 }
 
+/**
+ * Prijimac ceka na start byte, zatim neprisel zadny ramec
+ */
+boolean isAwaitingStart() {
+  return recvPhase == startByte;
+}
+
 void stopReceiver() {
   recvPhase = idle;
   errorAtEnd = 0;
 }
 
+/**
+ * Nejstarsi prijaty ramec, NULL pokud zadny neni. Plati do `releaseReceivedFrame`.
+ */
+const CommFrame* receivedFrame() {
+  return (recvSlotReady > 0) ? (const CommFrame*)recvSlots[recvSlotFirst] : NULL;
+}
+
+/**
+ * Vrati slot nejstarsiho prijateho ramce k dalsimu prijmu.
+ */
+void releaseReceivedFrame() {
+  if (recvSlotReady == 0) {
+    return;
+  }
+  recvSlotFirst = (recvSlotFirst + 1) % recvSlotCount;
+  recvSlotReady--;
+}
+
 void initPayload() {
   initChecksum(recvXor);
   checksumUpdate(recvXor, startByteChar);
   recvPhase = length;
-  recvPtr = &recvFrame.len;
+  recvPtr = &recvFrame().len;
 }
 
 /**
- * Nutno volat periodicky pro spravne timeoutovani pri cekani
+ * Nutno volat periodicky: dekoduje prijata data a hlida timeouty pri cekani
  * na start byte, pripadne na dalsi byte packetu
  */
 void periodicReceiveCheck() {
+  byte t = recvRingTail;
+  if (t != recvRingHead) {
+    lastReceiveMillis = currentMillis;
+    recordStartTime(busActivityTime);
+    do {
+      receiveByte(recvRing[t]);
+      recvByteCount++;
+      t = (t + 1) & (recvRingSize - 1);
+    } while (t != recvRingHead);
+    recvRingTail = t;
+  }
 #ifndef NEO
-  if (commSerial.available()) {
-    isrReceiveData(commSerial.read());
+  while (commSerial.available()) {
+    lastReceiveMillis = currentMillis;
+    recordStartTime(busActivityTime);
+    receiveByte(commSerial.read());
+    recvByteCount++;
   }
 #endif
   if (isReceiving()) {
     long d = currentMillis - lastReceiveMillis;
-    boolean tm = false;
     if (recvPhase == startByte) {
       if (d > recvDelayStartByte) {
         if (debug485Frame) {
@@ -326,12 +465,25 @@ void periodicReceiveCheck() {
 }
 
 /**
- * Interrupt routine
+ * Interrupt routine; jen ulozi byte pro `periodicReceiveCheck`.
  */
 void isrReceiveData(uint8_t data) {
+  byte h = recvRingHead;
+  byte n = (h + 1) & (recvRingSize - 1);
+  if (n == recvRingTail) {
+    recvRingOverruns++;
+    return;
+  }
+  recvRing[h] = data;
+  recvRingHead = n;
+}
+
+/**
+ * Zpracuje jeden prijaty byte: synchronizace na start byte, escape, kontrolni soucet.
+ */
+void receiveByte(byte data) {
   byte ph = recvPhase;
-  
-  lastReceiveMillis = millis();
+
   if ((ph == idle) || (ph == startByte)) {
     // in case of data incoming during idle, switch to startByte = active reading.
     // will skip unexpected packet on the wire.
@@ -344,7 +496,6 @@ void isrReceiveData(uint8_t data) {
       return;
     }
     initPayload();
-    Serial.print("Start byte: "); Serial.println(lastReceiveMillis & 0xffff);
     if (debug485Recv) {
       Serial.println(F("Got start"));
     }
@@ -359,8 +510,8 @@ void isrReceiveData(uint8_t data) {
     if (debug485Recv) {
       Serial.println(F("Got escape"));
     }
-    recvPhase2 = ph;
-    recvPhase = ph = escape;
+    recvPhase2 = (CommPhase)ph;
+    ph = recvPhase = escape;
     return;
   }
   if (data == startByteChar) {
@@ -374,27 +525,47 @@ void isrReceiveData(uint8_t data) {
     if (debug485Recv) {
       Serial.print(F("Escaped data: ")); Serial.println(data, HEX);
     }
-    recvPhase = ph = recvPhase2;
+    ph = recvPhase = recvPhase2;
   }
   if (ph == length) {
+    byte fold = data >> lenFoldShift;
+    recvFoldPtr = NULL;
+    if (fold > 0) {
+      data = (data & lenFoldMask) + 1;
+      recvFoldByte = fold - 1;
+      recvFoldPtr = &recvFrame().dataStart;
+    }
     // frameSize obsahuje take vlastni delku packetu; bude odpoctena jeste v tomto cyklu
-    recvCounter = recvFrame.frameSize(data);
+    recvCounter = CommFrame::frameSize(data);
     if (recvCounter > recvBufferSize) {
-      recvPhase = ph = discard;
-      Serial.print(F("Small recv buffer: ")); Serial.println(recvCounter);
+      ph = recvPhase = discard;
+      if (debug485Frame) {
+        Serial.print(F("Small recv buffer: ")); Serial.println(recvCounter);
+      }
       errorAtEnd = errLong;
       // v dalsim if-u se snizi pocitadlo
+    } else if (recvSlotReady >= recvSlotCount) {
+      // vsechny sloty drzi volajici
+      ph = recvPhase = discard;
+      recvSlotDrops++;
+      errorAtEnd = errOverrun;
     } else {
-      recvPhase = ph = payload;
+      ph = recvPhase = payload;
       // v dalsim if-u se snizi pocitadlo
     }
+    if (fold > 0) {
+      // prvni byte dat na drate neni
+      recvCounter--;
+    }
   }
   if (ph == payload) {
     *(recvPtr++) = data;
+    if (recvPtr == recvFoldPtr) {
+      *(recvPtr++) = recvFoldByte;
+    }
     recvCounter--;
   } else if (ph == discard) {
     recvCounter--;
-    Serial.print(F("Discard: ")); Serial.println(recvCounter);
   }
   
   if (ph == checksum) {
@@ -404,24 +575,19 @@ void isrReceiveData(uint8_t data) {
       Serial.print(F("recv Checksum: ")); Serial.println(data, HEX);
       Serial.print(F("xor = ")); Serial.println(recvXor, HEX);
     }
+    int err = errorAtEnd;
     stopReceiver();
-    if (errorAtEnd || !verifyChecksum(recvXor, recvChecksum)) {
+    if (err || !verifyChecksum(recvXor, recvChecksum)) {
       // Chyba v datech, zahodit.
       if (debug485Frame) {
         Serial.println(F("Error frame"));
       }
-      errorAtEnd = false;
-      if (errorAtEnd > 0) {
-        onReceiveError(errorAtEnd);
-      } else {
-        onReceiveError(errChecksum);
-      }
-      errorAtEnd = 0;
+      onReceiveError((err > 0) ? err : errChecksum);
     } else {
       if (debug485Frame) {
         Serial.println(F("Correct frame"));
       }
-      onReceivedMessage(recvFrame);
+      recvSlotReady++;
     }
   } else if (recvCounter == 0) {
     if (debug485Frame) {
@@ -431,4 +597,3 @@ void isrReceiveData(uint8_t data) {
     return;
   }
 }
-
@@ -101,6 +101,10 @@ void printPrompt() {
 void processTerminal() {
   while (Serial.available()) {
     char c = (char)Serial.read();
+    if (gatewayInput(c)) {
+      // binary record of the USB gateway
+      continue;
+    }
     if (charModeCallback != NULL) {
       if (c == '`') {
         // reset from the character mode
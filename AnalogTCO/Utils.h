@@ -8,6 +8,10 @@ const byte inputColumnsRounded = ((inputColumns + 7) / 8) * 8;
 const byte inputByteSize = (inputRows * inputColumns + 7) / 8;
 
 const byte addressBroadcast = 0xff;
+/**
+ * Adresa prvni skupiny slave; skupiny nasleduji za sebou
+ */
+const byte addressGroupBase = 0x10;
 
 #ifdef FAST_ADDREESS
 #if defined(__AVR_ATmega328P__)  // Arduino UNO, NANO
@@ -85,7 +89,7 @@ boolean readBit(const byte* storage, int index) {
   return (*(storage + i) & m) > 0;
 }
 
-boolean writeBit(const byte* storage, int index, boolean state) {
+void writeBit(byte* storage, int index, boolean state) {
   byte i = index >> 3;
   byte m = 1 << (index & 0x07);
   byte *p = storage + i;
@@ -97,48 +101,90 @@ boolean writeBit(const byte* storage, int index, boolean state) {
   }
 }
 
+/**
+ * Tridy priority packetu ve fronte. Vyssi trida se odesila drive.
+ */
+enum BusPriority {
+  prioLow = 0,
+  prioNormal,
+  prioHigh,
+  prioUrgent
+};
+
 /** 
  *  Translation of physical keys into target:command
  */
 struct KeySpec {
-  byte  x : 4;
-  byte  y : 4;     
-  boolean matrix : 1 ;      // 1
-  byte  lenOrMatrix : 8;    // 8
-  byte  commandBase : 6;    
-  byte  target : 5;         // 5 ... 2 bit remain
-
-  boolean isEmpty() {
+  uint16_t  x : 6;            // sloupec, max 64
+  uint16_t  y : 4;            // radek, max 16
+  uint16_t  matrix : 1;
+  uint16_t  priority : 2;     // BusPriority
+  uint16_t  latch : 1;        // prepinac: novejsi stav nahradi neodeslany
+  uint16_t  lenOrMatrix : 10; // delka, nebo (vyska - 1) << 6 | (sirka - 1)
+  byte      commandBase;
+  byte      target;
+
+  boolean isEmpty() const {
     return target == 0;
   }
 
-  void range(byte s, byte len, byte t, byte b) {
+  byte width() const {
+    return (lenOrMatrix & 0x3f) + 1;
+  }
+
+  byte height() const {
+    return (lenOrMatrix >> 6) + 1;
+  }
+
+  void range(int s, int len, byte t, byte b) {
     y = (s / inputColumnsRounded);
     x = s - (y * inputColumnsRounded);
     matrix = 0;
     lenOrMatrix = len;
     target = t;
     commandBase = b;
+    priority = prioNormal;
+    latch = 0;
   }
 
   void rectangle(byte ax, byte ay, byte w, byte h, byte t, byte b) {
     x = ax; y = ay;
     matrix = 1;
-    lenOrMatrix = w | (h << 4);
+    lenOrMatrix = w | (h << 6);
     target = t;
     commandBase = b;
+    priority = prioNormal;
+    latch = 0;
   }
 
   void printDef();
 };
 
-static_assert(sizeof(KeySpec) > 3, "Large keyspec");
+static_assert(sizeof(KeySpec) <= 6, "Large keyspec");
 
 
 byte analogTTLRead(byte pin) {
   return (analogRead(pin) > ((1024 / 50) * 25)) ? 1 : 0;
 }
 
+/**
+ * Kod operace, prvni byte dat v packetu
+ */
+enum RemoteOperation {
+  /**
+   * Zkouska, zda slave zije; slave jen potvrdi
+   */
+  opProbe = 0,
+  opKeyCommand = 1,
+  opSensorDelta = 2,
+  opSensorSnapshot = 3,
+  opKeySnapshot = 4,
+  /**
+   * Predani pesku (tokenu) dalsimu masteru na sbernici, viz BusMaster
+   */
+  opToken = 5
+};
+
 struct RemoteCommand {
   byte    operation;
   byte    commandId;
@@ -147,4 +193,23 @@ struct RemoteCommand {
   RemoteCommand(byte aop, byte acommand, boolean apress) : operation(aop), commandId(acommand), pressed(apress) {}
 };
 
+/**
+ * Prikaz klavesy do `msg`, vrati delku dat. Prikaz pod 128 se posle v kompaktnim tvaru [opKeyCommand] [stav << 7 | prikaz]:
+ * kod operace se prenese v byte delky ramce, takze klavesa stoji na drate 6 byte (pro prikaz pod 125 bez escape).
+ * Vyssi prikazy se posilaji jako RemoteCommand; slave oba tvary rozlisi podle delky. Prikaz nad 255 se zakodovat neda, vrati 0.
+ */
+byte encodeKeyCommand(byte* msg, int command, boolean pressed) {
+  if ((command < 0) || (command > 0xff)) {
+    return 0;
+  }
+  if (command < 0x80) {
+    msg[0] = opKeyCommand;
+    msg[1] = (pressed ? 0x80 : 0) | command;
+    return 2;
+  }
+  RemoteCommand cmd(opKeyCommand, command, pressed);
+  memcpy(msg, &cmd, sizeof(cmd));
+  return sizeof(cmd);
+}
+
 
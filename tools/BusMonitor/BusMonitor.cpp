@@ -0,0 +1,145 @@
+/**
+ * Prints the binary output of the bus analyzer (BusMonitor.ino, command MON:1) as text.
+ *
+ * Reads a capture file, or the Arduino's serial port set to raw mode, or stdin. Records are
+ *    [sync] [type] [length] [data ...] [xor of type, length and data]
+ * Anything else on the line (terminal echo, messages) is skipped until the next valid record.
+ * The 16-bit times of frames and errors are extended by the 32-bit time of the last statistics record.
+ *
+ * The constants below must match BusMonitor.ino and Config.h of the sketch.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+const uint8_t monitorSync = 0xa5;
+const uint8_t monitorFrame = 'F';
+const uint8_t monitorError = 'E';
+const uint8_t monitorStats = 'S';
+
+const int maxSlaves = 16;
+const int maxBusGroups = 4;
+const int monitorErrorKinds = 6;
+const int monitorTargets = maxSlaves + maxBusGroups + 1;
+const int monitorStatsSize = 4 + 2 + 2 + 2 + monitorErrorKinds + 1 + maxSlaves + monitorTargets;
+
+/**
+ * 10 bits per character at 9600 Bd
+ */
+const double charMillis = 10 * 1000.0 / 9600;
+
+const char* errorNames[] = { "none", "checksum", "long", "timeout", "unexpected", "timeout-start", "overrun" };
+
+uint32_t lastTime = 0;
+
+double extendTime(const uint8_t* d) {
+  uint32_t t = (lastTime & ~0xffffUL) | (d[0] | (d[1] << 8));
+  if (t + 0x8000UL < lastTime) {
+    t += 0x10000UL;
+  }
+  return t / 1000.0;
+}
+
+void printFrame(const uint8_t* d, int n) {
+  if (n < 5) {
+    return;
+  }
+  printf("%10.3f  %3d -> %3d  len %2d ", extendTime(d), d[4], d[3], d[2]);
+  for (int i = 5; i < n; i++) {
+    printf(" %02x", d[i]);
+  }
+  printf("\n");
+}
+
+void printError(const uint8_t* d, int n) {
+  if (n < 3) {
+    return;
+  }
+  int e = d[2];
+  printf("%10.3f  error %s\n", extendTime(d), (e < (int)(sizeof(errorNames) / sizeof(errorNames[0]))) ? errorNames[e] : "?");
+}
+
+void printCounts(const char* title, const uint8_t* c, int n, int base) {
+  printf(" | %s", title);
+  for (int i = 0; i < n; i++) {
+    if (c[i] == 0) {
+      continue;
+    }
+    if (i + base < maxSlaves) {
+      printf(" %d:%d", i + base, c[i]);
+    } else if (i + base < maxSlaves + maxBusGroups) {
+      printf(" g%d:%d", i + base - maxSlaves + 1, c[i]);
+    } else {
+      printf(" bc:%d", c[i]);
+    }
+  }
+}
+
+void printStats(const uint8_t* d, int n) {
+  if (n != monitorStatsSize) {
+    printf("# statistics of unexpected size %d\n", n);
+    return;
+  }
+  lastTime = d[0] | (d[1] << 8) | ((uint32_t)d[2] << 16) | ((uint32_t)d[3] << 24);
+  unsigned period = d[4] | (d[5] << 8);
+  unsigned bytes = d[6] | (d[7] << 8);
+  unsigned frames = d[8] | (d[9] << 8);
+  double secs = period ? period / 1000.0 : 1;
+  const uint8_t* e = d + 10;
+  printf("# %9.3f  util %5.1f %%  %6.1f frames/s  errors", lastTime / 1000.0, period ? 100.0 * bytes * charMillis / period : 0, frames / secs);
+  for (int i = 0; i < monitorErrorKinds; i++) {
+    if (i + 1 != 5) {
+      printf(" %s %d", errorNames[i + 1], e[i]);
+    }
+  }
+  printf("  lost %d", e[monitorErrorKinds]);
+  const uint8_t* from = e + monitorErrorKinds + 1;
+  printCounts("from", from, maxSlaves, 0);
+  printCounts("to", from + maxSlaves, monitorTargets, 0);
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  FILE* in = stdin;
+  if (argc > 1) {
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+      perror(argv[1]);
+      return 2;
+    }
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  // sync, type, length, up to 255 data bytes, xor
+  uint8_t buf[260];
+  int have = 0;
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    buf[have++] = c;
+    while (have > 0) {
+      if (buf[0] != monitorSync) {
+        memmove(buf, buf + 1, --have);
+        continue;
+      }
+      if (have < 3 || have < buf[2] + 4) {
+        break;
+      }
+      int n = buf[2];
+      uint8_t x = buf[1] ^ n;
+      for (int i = 0; i < n; i++) {
+        x ^= buf[3 + i];
+      }
+      if (x != buf[3 + n]) {
+        memmove(buf, buf + 1, --have);
+        continue;
+      }
+      switch (buf[1]) {
+        case monitorFrame: printFrame(buf + 3, n); break;
+        case monitorError: printError(buf + 3, n); break;
+        case monitorStats: printStats(buf + 3, n); break;
+      }
+      have -= n + 4;
+      memmove(buf, buf + n + 4, have);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,1121 @@
+/**
+ * Host-side simulator of the RS485 bus.
+ *
+ * Runs the real RS485Frame.ino and BusMaster.ino (copied from the sketch by the Makefile) as the bus master
+ * against simulated slaves on a virtual half-duplex wire. The wire models character timing at 9600 Bd,
+ * collisions of overlapping transmissions and random bit errors. Slaves decode the frames with their own
+ * decoder and answer with an ACK after a turnaround delay - or not at all, if they are dead or flaky.
+ *
+ * The workload is a Poisson stream of key events; each event queues one RemoteCommand-sized message
+ * per target through addMessage(), or a single group frame for all the targets (-g). With -k the message has the compact
+ * 2-byte form of encodeKeyCommand() instead. Group members
+ * acknowledge in their slots, like the slave firmware does. The firmware loop is modelled as transmitFrames() followed by
+ * a fixed amount of other work (keyboard scan, terminal ...).
+ *
+ * With -M the bus is shared with other masters. They are idealized: when one gets the token, it keeps the wire busy with its own
+ * traffic for the hold time (-H) and passes the token to the next live master, skipping the dead ones without a timeout. A peer can
+ * die (-x) while it holds the token; the firmware must then regenerate it. Peers never regenerate the token themselves.
+ *
+ * With -A the firmware runs as the passive bus analyzer (BusMonitor.ino) instead of the master: the other masters (-M) pass the token
+ * among themselves and the firmware's binary output is written to a file. The report compares the captured frames with the good frames
+ * on the wire. The USB serial line is not modelled, its speed is unlimited.
+ *
+ * With -F the slaves have feedback (turnout positions ...) which changes at random. A slave appends its unsent changes to the next unicast ACK,
+ * like the slave firmware does; the firmware polls the slaves when it has nothing else to send. A change carried by a lost ACK is lost.
+ *
+ * At the end the simulator reports throughput, ACK latency percentiles, retry counts and queue occupancy.
+ * Firmware constants (msgBufferSize, maxPacketRepeats, ...) can be changed at build time, see the Makefile.
+ */
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <vector>
+#include <map>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <string>
+
+#include "Arduino.h"
+#include "SoftwareSerial.h"
+
+#include "Config.h"
+#include "Utils.h"
+#include "RS485Frame.h"
+#include "EEData.h"
+#include "Common.h"
+#include "protos.h"
+
+/////////////////////// Globals normally defined by the sketch main file ////////////////////////
+
+EEData eeData;
+char printBuffer[50];
+uint32_t currentMillis = 0;  // AVR widths, see SED_AVR_TYPES in the Makefile
+uint16_t currentMillisLow = 0;
+char *inputPos;
+char *inputEnd;
+
+void registerLineCommand(const char* cmd, void (*aHandler)()) {
+}
+
+int nextNumber() {
+  return -2;
+}
+
+void onSlaveUp(byte t) {
+}
+
+void onSlaveFeedback(byte t, byte n, boolean state);
+
+#include "RS485Frame.ino"
+#include "BusMaster.ino"
+#include "BusMonitor.ino"
+
+/////////////////////////////////// The simulated world //////////////////////////////////////////
+
+namespace bussim {
+
+const int masterNode = -1;
+const uint32_t baudRate = 9600;
+/**
+ * One character on the wire: start bit, 8 data bits, stop bit.
+ */
+const uint64_t charTime = (10 * 1000000 + baudRate - 1) / baudRate;
+
+/**
+ * Size of the SoftwareSerial receive buffer.
+ */
+const size_t masterRxSize = 64;
+
+/**
+ * Marks the simulated key event payload: RemoteCommand layout, commandId and pressed carry the sequence number.
+ * The compact form carries the low 8 bits of the sequence number, see tagSeq.
+ */
+const byte workloadOperation = opKeyCommand;
+
+// ---------------------------- parameters -------------------------------
+int slaveCount = 8;
+double duration = 60;
+double eventRate = 5;
+int burstSize = 1;
+bool useGroup = false;
+bool compactKeys = false;
+double urgentShare = 0;
+double bitErrorRate = 0;
+double missRate = 0;
+double reviveTime = 0;
+uint32_t turnaround = 2000;
+uint32_t turnaroundJitter = 500;
+uint32_t loopTime = 500;
+unsigned seed = 1;
+bool verbose = false;
+std::vector<int> deadAddresses;
+int peerCount = 0;
+uint32_t peerHold = 30;
+double peerDeath = 0;
+double peerRevive = 0;
+const char* analyzerFile = NULL;
+double feedbackRate = 0;
+
+// ---------------------------- state -------------------------------
+uint64_t now = 0;
+std::mt19937 rng;
+
+double uniform() {
+  return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+}
+
+struct WireByte {
+  uint64_t start;
+  uint64_t end;
+  int sender;
+  byte sent;          // what the sender meant to transmit
+  byte data;          // what is on the wire
+  bool damaged;
+  bool firstOfFrame;
+  bool lastOfFrame;
+  int ackSeq;         // message acknowledged by this (slave) frame, -1 if none
+};
+
+/**
+ * Bytes on the wire, ordered by the time their stop bit ends.
+ */
+std::multimap<uint64_t, WireByte> wire;
+
+bool masterDriving = false;
+std::deque<byte> masterRx;
+
+/**
+ * Receiving side of the framing, independent of the firmware code.
+ */
+struct FrameDecoder {
+  /**
+   * Decoded frame in the CommFrame layout; the queue header (retryCount ...) is not transmitted and stays empty.
+   */
+  byte buf[64];
+  byte count = 0;
+  byte expected = 0;
+  byte sum = 0;
+  byte checksum = 0;
+  bool active = false;
+  bool escape = false;
+  int folded = -1;    // first data byte carried in the length byte, -1 if none
+
+  /**
+   * Feeds one raw byte. Returns true when a frame with a good checksum is complete, see frame().
+   */
+  bool feed(byte b) {
+    if (b == startByteChar) {
+      active = true;
+      escape = false;
+      count = 0;
+      expected = 0;
+      sum = b;
+      return false;
+    }
+    if (!active) {
+      return false;
+    }
+    sum ^= b;
+    if (b == escapeChar) {
+      escape = true;
+      return false;
+    }
+    if (escape) {
+      b ^= escapeChar;
+      escape = false;
+    }
+    if (count == 0) {
+      folded = -1;
+      if (b >> 5) {
+        folded = (b >> 5) - 1;
+        b = (b & 0x1f) + 1;
+      }
+      expected = CommFrame::frameSize(b);
+      if (expected + frameQueueHeader >= (int)sizeof(buf)) {
+        active = false;
+        return false;
+      }
+    }
+    if (count < expected) {
+      buf[frameQueueHeader + count++] = b;
+      if (folded >= 0 && frameQueueHeader + count == offsetof(CommFrame, dataStart)) {
+        buf[frameQueueHeader + count++] = folded;
+      }
+      return false;
+    }
+    active = false;
+    checksum = b;
+    return sum == 0;
+  }
+
+  const CommFrame& frame() const {
+    return *(const CommFrame*)buf;
+  }
+};
+
+struct Slave {
+  byte address;
+  bool alive = true;
+  FrameDecoder decoder;
+  bool ackDamaged = false;
+  long framesReceived = 0;
+  long acksSent = 0;
+  /**
+   * Feedback state, changes not sent yet; when the first unsent change of each bit happened, and when the last sent one did
+   */
+  unsigned int feedback = 0;
+  unsigned int feedbackUnsent = 0;
+  uint64_t changedAt[maxFeedbackBits];
+  uint64_t sentChangedAt[maxFeedbackBits];
+};
+
+std::vector<Slave> slaves;
+
+/**
+ * Another master sharing the bus; wire sender `peerNodeBase` + index.
+ */
+struct Peer {
+  byte address;
+  bool alive = true;
+  FrameDecoder decoder;
+  long tokens = 0;
+};
+
+const int peerNodeBase = 1000;
+std::vector<Peer> peers;
+FrameDecoder masterMonitor;
+
+/**
+ * Reference decoder of everything on the wire, and the analyzer output
+ */
+FrameDecoder wireMonitor;
+long wireFrames = 0;
+FILE* analyzerOut = NULL;
+std::vector<byte> analyzerStream;
+
+/**
+ * Life of one queued message.
+ */
+struct Message {
+  unsigned int targets = 0;
+  unsigned int ackedBy = 0;
+  bool urgent = false;
+  uint64_t queued = 0;
+  uint64_t lastTxEnd = 0;
+  uint64_t ackAt = 0;
+  uint64_t done = 0;
+  int transmissions = 0;
+  bool inQueue = false;
+  bool rejected = false;
+};
+
+std::vector<Message> messages;
+std::vector<long> seenInQueue;
+long observeRound = 0;
+
+// ---------------------------- statistics -------------------------------
+uint64_t wireBusy = 0;
+long masterFrames = 0;
+long ackFrames = 0;
+long collisions = 0;
+long rxOverflows = 0;
+long damagedBytes = 0;
+std::vector<double> rtts;
+double queueByteTime = 0;
+int queueMax = 0;
+uint64_t lastObserve = 0;
+long feedbackGenerated = 0;
+long feedbackSent = 0;
+std::vector<double> feedbackLatency;
+
+void deliver(const WireByte& b);
+
+/**
+ * Puts a byte on the wire; applies bit errors and detects collisions with other senders.
+ */
+void schedule(WireByte b) {
+  b.data = b.sent;
+  b.damaged = false;
+  for (int bit = 0; bit < 8; bit++) {
+    if (bitErrorRate > 0 && uniform() < bitErrorRate) {
+      b.data ^= (1 << bit);
+      b.damaged = true;
+    }
+  }
+  auto it = wire.upper_bound(b.start);
+  auto last = wire.upper_bound(b.end + charTime);
+  for (; it != last; ++it) {
+    WireByte& o = it->second;
+    if (o.sender == b.sender || o.start >= b.end || o.end <= b.start) {
+      continue;
+    }
+    if (!o.damaged) {
+      collisions++;
+    }
+    o.damaged = b.damaged = true;
+    o.data ^= (byte)(1 + (rng() % 255));
+    b.data ^= (byte)(1 + (rng() % 255));
+  }
+  if (b.damaged) {
+    damagedBytes++;
+  }
+  wire.insert(std::make_pair(b.end, b));
+}
+
+/**
+ * Delivers everything which has completely passed the wire until time `t`.
+ */
+void run(uint64_t t) {
+  while (!wire.empty() && wire.begin()->first <= t) {
+    WireByte b = wire.begin()->second;
+    wire.erase(wire.begin());
+    deliver(b);
+  }
+}
+
+void encodeFrame(const byte* frame, byte n, std::vector<byte>& out) {
+  byte x = startByteChar;
+  out.push_back(startByteChar);
+  for (byte i = 0; i <= n; i++) {
+    byte b = (i < n) ? frame[i] : x;
+    if (b >= escapeChar && b <= escapeTop) {
+      out.push_back(escapeChar);
+      out.push_back(b ^ escapeChar);
+      if (i < n) {
+        x ^= escapeChar ^ (b ^ escapeChar);
+      }
+    } else {
+      out.push_back(b);
+      if (i < n) {
+        x ^= b;
+      }
+    }
+  }
+}
+
+/**
+ * Message of the compact workload payload, by its 8-bit tag. Tags are unique while the message is queued, the queue is much shorter.
+ */
+int tagSeq[256];
+
+int messageSeq(const CommFrame& f) {
+  const byte* d = f.data();
+  byte len = f.len;
+  if (isGroup(f.to)) {
+    d += 2;
+    len -= 2;
+  }
+  if (d[0] != workloadOperation) {
+    return -1;
+  }
+  if (len == 2) {
+    return tagSeq[d[1]];
+  }
+  if (len != 3) {
+    return -1;
+  }
+  return d[1] | (d[2] << 8);
+}
+
+/**
+ * Puts a whole frame (CommFrame layout from `len`) on the wire from `start`; returns the time its last byte ends.
+ */
+uint64_t scheduleFrame(const byte* frame, byte n, int sender, uint64_t start, int ackSeq) {
+  std::vector<byte> raw;
+  encodeFrame(frame, n, raw);
+  for (size_t i = 0; i < raw.size(); i++) {
+    WireByte b;
+    b.start = start + i * charTime;
+    b.end = b.start + charTime;
+    b.sender = sender;
+    b.sent = raw[i];
+    b.firstOfFrame = (i == 0);
+    b.lastOfFrame = (i == raw.size() - 1);
+    b.ackSeq = ackSeq;
+    schedule(b);
+  }
+  return start + raw.size() * charTime;
+}
+
+/**
+ * Next live master after `address`, in the order of addresses.
+ */
+byte nextMaster(byte address) {
+  for (int i = 1; i < maxSlaves; i++) {
+    byte a = (address + i) % maxSlaves;
+    if (a == busMasterId && analyzerOut == NULL) {
+      return a;
+    }
+    for (const Peer& p : peers) {
+      if (p.address == a && p.alive) {
+        return a;
+      }
+    }
+  }
+  return address;
+}
+
+void peerGotToken(Peer& p, uint64_t at) {
+  p.tokens++;
+  int sender = peerNodeBase + (&p - &peers[0]);
+  uint64_t t = at + turnaround;
+  uint64_t end = t + peerHold * 1000ULL;
+  // own traffic, frames to a nonexistent address
+  byte data[] = { 3, (byte)(maxSlaves - 1), p.address, 0x10, 0x11, 0x12 };
+  while (t < end) {
+    t = scheduleFrame(data, sizeof(data), sender, t, -1) + turnaround;
+  }
+  byte token[] = { 1, nextMaster(p.address), p.address, opToken };
+  scheduleFrame(token, sizeof(token), sender, t, -1);
+}
+
+void peerReceived(Peer& p, uint64_t at) {
+  const CommFrame& f = p.decoder.frame();
+  if (!p.alive || f.to != p.address || f.len != 1 || f.dataStart != opToken) {
+    return;
+  }
+  peerGotToken(p, at);
+}
+
+void killPeer(Peer& p) {
+  p.alive = false;
+  int sender = peerNodeBase + (&p - &peers[0]);
+  for (auto it = wire.begin(); it != wire.end(); ) {
+    if (it->second.sender == sender && it->second.start >= now) {
+      it = wire.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void slaveReceived(Slave& s, uint64_t at, checksum_t sum) {
+  const CommFrame& f = s.decoder.frame();
+  int slot = 0;
+  if (isGroup(f.to)) {
+    unsigned int members = f.data()[0] | (f.data()[1] << 8);
+    if (!(members & (1U << s.address))) {
+      return;
+    }
+    for (unsigned int m = members & ((1U << s.address) - 1); m; m &= m - 1) {
+      slot++;
+    }
+  } else if (f.to != s.address) {
+    return;
+  }
+  s.framesReceived++;
+  if (missRate > 0 && uniform() < missRate) {
+    return;
+  }
+  byte ack[3 + sizeof(checksum_t) + maxAckStatus] = { sizeof(checksum_t), f.from, s.address, sum };
+  for (int n = 0; n < maxFeedbackBits && s.feedbackUnsent && !isGroup(f.to); n++) {
+    if (!(s.feedbackUnsent & (1U << n))) {
+      continue;
+    }
+    if (ack[0] == sizeof(checksum_t) + maxAckStatus - 1) {
+      ack[3 + ack[0]++] = feedbackMore;
+      break;
+    }
+    ack[3 + ack[0]++] = n | ((s.feedback & (1U << n)) ? 0x80 : 0);
+    s.sentChangedAt[n] = s.changedAt[n];
+    s.feedbackUnsent &= ~(1U << n);
+    feedbackSent++;
+  }
+  uint64_t start = at + slot * groupAckSlot * 1000 + turnaround + (turnaroundJitter ? rng() % turnaroundJitter : 0);
+  scheduleFrame(ack, 3 + ack[0], &s - &slaves[0], start, (f.from == busMasterId) ? messageSeq(f) : -1);
+  s.acksSent++;
+}
+
+void deliver(const WireByte& b) {
+  wireBusy += charTime;
+  if (wireMonitor.feed(b.data)) {
+    wireFrames++;
+  }
+  for (Slave& s : slaves) {
+    if (!s.alive || (&s - &slaves[0]) == b.sender) {
+      continue;
+    }
+    if (s.decoder.feed(b.data)) {
+      slaveReceived(s, b.end, s.decoder.checksum);
+    }
+  }
+  for (Peer& p : peers) {
+    if (p.alive && (peerNodeBase + (&p - &peers[0])) != b.sender && p.decoder.feed(b.data)) {
+      peerReceived(p, b.end);
+    }
+  }
+  if (b.sender == masterNode) {
+    if (masterMonitor.feed(b.sent)) {
+      masterFrames++;
+      int seq = messageSeq(masterMonitor.frame());
+      if (seq >= 0 && seq < (int)messages.size()) {
+        messages[seq].transmissions++;
+        messages[seq].lastTxEnd = b.end;
+      }
+    }
+    return;
+  }
+  if (b.sender >= peerNodeBase) {
+    if (masterDriving) {
+      // the firmware transmits over another master's frame
+      return;
+    }
+    if (masterRx.size() < masterRxSize) {
+      masterRx.push_back(b.data);
+    } else {
+      rxOverflows++;
+    }
+    return;
+  }
+  Slave& s = slaves[b.sender];
+  if (b.firstOfFrame) {
+    s.ackDamaged = false;
+  }
+  bool received = false;
+  if (!masterDriving) {
+    if (masterRx.size() < masterRxSize) {
+      masterRx.push_back(b.data);
+      received = true;
+    } else {
+      rxOverflows++;
+    }
+  }
+  if (b.damaged || !received) {
+    s.ackDamaged = true;
+  }
+  if (b.lastOfFrame) {
+    ackFrames++;
+    if (!s.ackDamaged && b.ackSeq >= 0 && b.ackSeq < (int)messages.size()) {
+      Message& m = messages[b.ackSeq];
+      m.ackedBy |= 1U << s.address;
+      if (m.ackAt == 0 && (m.ackedBy & m.targets) == m.targets) {
+        m.ackAt = b.end;
+      }
+      rtts.push_back((b.end - m.lastTxEnd) / 1000.0);
+    }
+  }
+}
+
+/**
+ * Walks the live part of the BusMaster queue: frames skipped for a later repeat
+ * at the start of the buffer, then the frames not processed yet.
+ */
+template<typename F> void forEachQueued(F fn) {
+  for (CommFrame* f = (CommFrame*)msgBuffer; (byte*)f < msgBufferHead; f = f->next()) {
+    fn(*f);
+  }
+  if (sendPacket != NULL) {
+    for (CommFrame* f = sendPacket; (byte*)f < msgBufferTop; f = f->next()) {
+      fn(*f);
+    }
+  }
+}
+
+void observe() {
+  observeRound++;
+  int bytes = 0;
+  forEachQueued([&](CommFrame& f) {
+    bytes += f.bufferSize();
+    int seq = messageSeq(f);
+    if (seq >= 0 && seq < (int)messages.size()) {
+      seenInQueue[seq] = observeRound;
+    }
+  });
+  for (size_t i = 0; i < messages.size(); i++) {
+    Message& m = messages[i];
+    if (m.inQueue && seenInQueue[i] != observeRound) {
+      m.inQueue = false;
+      m.done = now;
+    }
+  }
+  queueByteTime += (double)bytes * (now - lastObserve);
+  lastObserve = now;
+  queueMax = std::max(queueMax, bytes);
+}
+
+/**
+ * One feedback bit of a random live slave changes.
+ */
+void changeFeedback() {
+  Slave& s = slaves[rng() % slaves.size()];
+  if (!s.alive) {
+    return;
+  }
+  int n = rng() % maxFeedbackBits;
+  s.feedback ^= (1U << n);
+  if (!(s.feedbackUnsent & (1U << n))) {
+    s.feedbackUnsent |= (1U << n);
+    s.changedAt[n] = now;
+  }
+  feedbackGenerated++;
+}
+
+void queueEvent(uint64_t at) {
+  std::vector<int> targets;
+  for (Slave& s : slaves) {
+    targets.push_back(s.address);
+  }
+  std::shuffle(targets.begin(), targets.end(), rng);
+  int count = std::min(burstSize, (int)targets.size());
+  unsigned int groupMask = 0;
+  for (int i = 0; i < count; i++) {
+    groupMask |= 1U << targets[i];
+  }
+  bool urgent = (urgentShare > 0) && (uniform() < urgentShare);
+  for (int i = 0; i < (useGroup ? 1 : count); i++) {
+    if (messages.size() >= 0xffff) {
+      return;
+    }
+    int seq = messages.size();
+    messages.push_back(Message());
+    seenInQueue.push_back(0);
+    Message& m = messages.back();
+    m.queued = at;
+    m.urgent = urgent;
+    byte priority = urgent ? prioUrgent : prioNormal;
+
+    byte payload[] = { workloadOperation, (byte)(seq & 0xff), (byte)(seq >> 8) };
+    byte len = sizeof(payload);
+    if (compactKeys) {
+      len = encodeKeyCommand(payload, seq & 0x7f, (seq & 0x80) != 0);
+      tagSeq[payload[1]] = seq;
+    }
+    if (useGroup) {
+      m.targets = busGroups[0] = groupMask;
+      addMessage(addressGroupBase, busMasterId, payload, len, priority, 0, false);
+    } else {
+      m.targets = 1U << targets[i];
+      addMessage(targets[i], busMasterId, payload, len, priority, 0, false);
+    }
+    observe();
+    m.inQueue = (seenInQueue[seq] == observeRound);
+    m.rejected = !m.inQueue;
+  }
+}
+
+double percentile(std::vector<double> v, double p) {
+  if (v.empty()) {
+    return NAN;
+  }
+  std::sort(v.begin(), v.end());
+  return v[(size_t)(p * (v.size() - 1) + 0.5)];
+}
+
+void printPercentiles(const char* title, const std::vector<double>& v) {
+  printf("%-14s: p50 %6.1f  p90 %6.1f  p99 %6.1f  max %6.1f  (%zu samples)\n", title,
+    percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99), percentile(v, 1.0), v.size());
+}
+
+/**
+ * Parses the analyzer output, see BusMonitor.ino
+ */
+void reportAnalyzer() {
+  long frames = 0, errors = 0, stats = 0, bad = 0, lost = 0;
+  long captured = 0, errorCounts = 0;
+  const std::vector<byte>& v = analyzerStream;
+  size_t i = 0;
+  while (i + 3 < v.size()) {
+    if (v[i] != monitorSync) {
+      bad++;
+      i++;
+      continue;
+    }
+    byte type = v[i + 1];
+    byte n = v[i + 2];
+    if (i + 3 + n >= v.size()) {
+      break;
+    }
+    byte x = type ^ n;
+    for (byte k = 0; k < n; k++) {
+      x ^= v[i + 3 + k];
+    }
+    if (x != v[i + 3 + n]) {
+      bad++;
+      i++;
+      continue;
+    }
+    const byte* d = &v[i + 3];
+    if (type == monitorFrame) {
+      frames++;
+    } else if (type == monitorError) {
+      errors++;
+    } else if (type == monitorStats && n == monitorStatsSize) {
+      stats++;
+      captured += d[8] | (d[9] << 8);
+      for (byte k = 0; k < monitorErrorKinds; k++) {
+        errorCounts += d[10 + k];
+      }
+      lost += d[10 + monitorErrorKinds];
+    }
+    i += 4 + n;
+  }
+  printf("Analyzer      : %ld good frames on the wire, %ld frame records (%ld in stats), %ld error records (%ld in stats), %ld stats, %ld lost, %ld bad bytes\n",
+    wireFrames, frames, captured, errors, errorCounts, stats, lost, bad);
+}
+
+void report() {
+  long delivered = 0, dropped = 0, rejected = 0, pending = 0;
+  std::vector<double> latency, urgentLatency;
+  std::map<int, long> retries;
+  for (const Message& m : messages) {
+    if (m.rejected) {
+      rejected++;
+    } else if (m.inQueue) {
+      pending++;
+    } else if (m.ackAt > 0) {
+      delivered++;
+      (m.urgent ? urgentLatency : latency).push_back((m.done - m.queued) / 1000.0);
+      retries[std::max(0, m.transmissions - 1)]++;
+    } else {
+      dropped++;
+      retries[std::max(0, m.transmissions - 1)]++;
+    }
+  }
+  double secs = now / 1e6;
+  int dead = deadAddresses.size();
+  printf("BusSim: %d slaves (%d dead), %.1f s, %u Bd, %.2f events/s x %d targets%s%s, BER %g, miss %g\n",
+    slaveCount, dead, secs, baudRate, eventRate, burstSize, useGroup ? " (group)" : "", compactKeys ? " (compact)" : "", bitErrorRate, missRate);
+  printf("Firmware      : msgBufferSize=%d maxPacketRepeats=%d ackTimeout=%d recvDelayStartByte=%d maxSlaves=%d\n",
+    msgBufferSize, maxPacketRepeats, ackTimeout, recvDelayStartByte, maxSlaves);
+  printf("Messages      : %zu offered, %ld ACKed (%.2f/s), %ld dropped, %ld rejected, %ld pending\n",
+    messages.size(), delivered, delivered / secs, dropped, rejected, pending);
+  printf("Wire          : %ld master frames (%.2f frames/s), %ld ACK frames, utilization %.1f %%\n",
+    masterFrames, masterFrames / secs, ackFrames, 100.0 * wireBusy / now);
+  printf("Errors        : %ld collisions, %ld damaged bytes, %ld master RX overflows\n",
+    collisions, damagedBytes, rxOverflows);
+  printPercentiles("ACK RTT [ms]", rtts);
+  printPercentiles("Latency [ms]", latency);
+  if (urgentShare > 0) {
+    printPercentiles("Urgent [ms]", urgentLatency);
+  }
+  printf("Retries       :");
+  for (auto& r : retries) {
+    printf("  %dx: %ld", r.first, r.second);
+  }
+  printf("\n");
+  printf("Queue [bytes] : avg %.1f, max %d of %d\n", queueByteTime / now, queueMax, msgBufferSize);
+  printf("ACK tmo [ms]  :");
+  for (const Slave& s : slaves) {
+    const SlaveLink& l = slaveLinks[s.address];
+    printf("  %d: %.1f/%u", s.address, slaveAckTimeout(s.address) / 1000.0, l.timeouts);
+  }
+  printf("  (timeout/count)\n");
+  if (!peers.empty()) {
+    printf("Token         : %u passes, %u regenerated, peer holds:", tokenPasses, tokenClaims);
+    for (const Peer& p : peers) {
+      printf("  %d: %ld%s", p.address, p.tokens, (mastersDown & (1U << p.address)) ? " (down)" : "");
+    }
+    printf("\n");
+  }
+  if (feedbackRate > 0) {
+    printf("Feedback      : %ld changes, %ld sent in ACKs, %u applied by the master, %u polls\n",
+      feedbackGenerated, feedbackSent, feedbackChanges, feedbackPolls);
+    printPercentiles("Feedback [ms]", feedbackLatency);
+  }
+  if (analyzerOut != NULL) {
+    reportAnalyzer();
+  }
+  printf("Slaves down   :");
+  for (const Slave& s : slaves) {
+    if (isSlaveDown(s.address)) {
+      printf(" %d", s.address);
+    }
+  }
+  printf("\n");
+}
+
+void usage() {
+  fprintf(stderr,
+    "Usage: BusSim [options]\n"
+    "  -n count    number of slaves, addresses start at 2, at most 14 (default %d)\n"
+    "  -t seconds  simulated time (default %g)\n"
+    "  -r rate     key events per second (default %g)\n"
+    "  -b count    targets per event, e.g. a route setting several boards (default %d)\n"
+    "  -g          send each event as one group frame to all its targets\n"
+    "  -k          compact key command payload (encodeKeyCommand)\n"
+    "  -u share    share of events queued with the urgent priority (default %g)\n"
+    "  -d a,b,...  addresses of dead slaves\n"
+    "  -w seconds  dead slaves come back after this time (default never)\n"
+    "  -m prob     probability that a slave ignores a frame (default %g)\n"
+    "  -e ber      bit error rate on the wire (default %g)\n"
+    "  -a usec     slave turnaround delay (default %u)\n"
+    "  -j usec     turnaround jitter (default %u)\n"
+    "  -l usec     time of the firmware loop besides transmitFrames() (default %u)\n"
+    "  -M count    other masters sharing the bus, addresses after the slaves (default %d)\n"
+    "  -H ms       how long another master transmits when it has the token (default %u)\n"
+    "  -x seconds  the first other master dies at this time\n"
+    "  -y seconds  ... and comes back at this time\n"
+    "  -F rate     feedback changes per second per slave, reported in ACKs (default none)\n"
+    "  -A file     run the firmware as the passive analyzer, write its output to the file\n"
+    "  -s seed     random seed (default %u)\n"
+    "  -v          print the firmware's Serial output to stderr\n",
+    slaveCount, duration, eventRate, burstSize, urgentShare, missRate, bitErrorRate, turnaround, turnaroundJitter, loopTime, peerCount, peerHold, seed);
+}
+
+}
+
+/////////////////////////////////// Arduino and library shims ////////////////////////////////////
+
+using namespace bussim;
+
+void onSlaveFeedback(byte t, byte n, boolean state) {
+  for (const Slave& s : slaves) {
+    if (s.address == t) {
+      feedbackLatency.push_back((now - s.sentChangedAt[n]) / 1000.0);
+    }
+  }
+}
+
+SimSerial Serial;
+
+unsigned long millis() {
+  return (unsigned long)(now / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)now;
+}
+
+void delay(unsigned long ms) {
+  now += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+  now += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin == rs485Direction) {
+    run(now);
+    masterDriving = (val != LOW);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return LOW;
+}
+
+int analogRead(uint8_t pin) {
+  return 0;
+}
+
+uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder) {
+  return 0;
+}
+
+void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val) {
+}
+
+char* itoa(int value, char* str, int base) {
+  char tmp[34];
+  char *p = tmp;
+  unsigned int v = (value < 0 && base == 10) ? -value : value;
+  do {
+    int d = v % base;
+    *p++ = d < 10 ? '0' + d : 'a' + d - 10;
+    v /= base;
+  } while (v);
+  char *o = str;
+  if (value < 0 && base == 10) {
+    *o++ = '-';
+  }
+  while (p > tmp) {
+    *o++ = *--p;
+  }
+  *o = 0;
+  return str;
+}
+
+size_t SimSerial::write(uint8_t c) {
+  if (analyzerOut != NULL) {
+    fputc(c, analyzerOut);
+    analyzerStream.push_back(c);
+    return 1;
+  }
+  if (verbose) {
+    fputc(c, stderr);
+  }
+  return 1;
+}
+
+size_t SimSerial::write(const char* s) {
+  size_t n = strlen(s);
+  return write((const uint8_t*)s, n);
+}
+
+size_t SimSerial::write(const uint8_t* buf, size_t len) {
+  if (analyzerOut != NULL) {
+    fwrite(buf, 1, len, analyzerOut);
+    analyzerStream.insert(analyzerStream.end(), buf, buf + len);
+    return len;
+  }
+  if (verbose) {
+    fwrite(buf, 1, len, stderr);
+  }
+  return len;
+}
+
+size_t SimSerial::printNumber(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *p = buf + sizeof(buf) - 1;
+  *p = 0;
+  do {
+    int d = n % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    n /= base;
+  } while (n);
+  return write(p);
+}
+
+size_t SimSerial::printSigned(long n, int base) {
+  if (base == DEC && n < 0) {
+    return write('-') + printNumber(-n, base);
+  }
+  return printNumber(n, base);
+}
+
+size_t SimSerial::print(double d, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, d);
+  return write(buf);
+}
+
+void SoftwareSerial::begin(long speed) {
+}
+
+bool SoftwareSerial::overflow() {
+  return false;
+}
+
+int SoftwareSerial::available() {
+  run(now);
+  return masterRx.size();
+}
+
+int SoftwareSerial::peek() {
+  run(now);
+  return masterRx.empty() ? -1 : masterRx.front();
+}
+
+int SoftwareSerial::read() {
+  run(now);
+  if (masterRx.empty()) {
+    return -1;
+  }
+  byte b = masterRx.front();
+  masterRx.pop_front();
+  return b;
+}
+
+size_t SoftwareSerial::write(uint8_t c) {
+  run(now);
+  WireByte b;
+  b.start = now;
+  b.end = now + charTime;
+  b.sender = masterNode;
+  b.sent = c;
+  b.firstOfFrame = b.lastOfFrame = false;
+  b.ackSeq = -1;
+  schedule(b);
+  // the library sends with interrupts disabled, blocking for the whole character
+  now = b.end;
+  return 1;
+}
+
+/////////////////////////////////////////// main ///////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:r:b:gku:d:w:m:e:a:j:l:M:H:x:y:F:A:s:vh")) != -1) {
+    switch (opt) {
+      case 'n': slaveCount = atoi(optarg); break;
+      case 't': duration = atof(optarg); break;
+      case 'r': eventRate = atof(optarg); break;
+      case 'b': burstSize = atoi(optarg); break;
+      case 'g': useGroup = true; break;
+      case 'k': compactKeys = true; break;
+      case 'u': urgentShare = atof(optarg); break;
+      case 'd':
+        for (char* p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+          deadAddresses.push_back(atoi(p));
+        }
+        break;
+      case 'w': reviveTime = atof(optarg); break;
+      case 'm': missRate = atof(optarg); break;
+      case 'e': bitErrorRate = atof(optarg); break;
+      case 'a': turnaround = atol(optarg); break;
+      case 'j': turnaroundJitter = atol(optarg); break;
+      case 'l': loopTime = atol(optarg); break;
+      case 'M': peerCount = atoi(optarg); break;
+      case 'H': peerHold = atol(optarg); break;
+      case 'x': peerDeath = atof(optarg); break;
+      case 'y': peerRevive = atof(optarg); break;
+      case 'F': feedbackRate = atof(optarg); break;
+      case 'A': analyzerFile = optarg; break;
+      case 's': seed = atol(optarg); break;
+      case 'v': verbose = true; break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  rng.seed(seed);
+
+  updateTime();
+  setupRS485Ports();
+  resetBusMaster();
+  if (slaveCount < 1 || busMasterId + slaveCount + peerCount >= maxSlaves) {
+    int needed = busMasterId + slaveCount + peerCount + 1;
+    if (needed > addressGroupBase) {
+      // the firmware limit: 16-bit member masks, group addresses from addressGroupBase
+      fprintf(stderr, "Addresses %d..%d do not fit: at most %d slaves and other masters, addresses end at %d\n",
+        busMasterId + 1, needed - 1, addressGroupBase - busMasterId - 1, addressGroupBase - 1);
+    } else {
+      fprintf(stderr, "Addresses %d..%d do not fit below maxSlaves=%d; rebuild with OVERRIDES=maxSlaves=%d\n",
+        busMasterId + 1, needed - 1, maxSlaves, needed);
+    }
+    return 2;
+  }
+  for (int i = 0; i < slaveCount; i++) {
+    Slave s;
+    s.address = busMasterId + 1 + i;
+    s.alive = std::find(deadAddresses.begin(), deadAddresses.end(), s.address) == deadAddresses.end();
+    slaves.push_back(s);
+    // simulated slaves decode the folded length byte
+    foldSlaves |= (1U << s.address);
+    if (feedbackRate > 0) {
+      feedbackSlaves |= (1U << s.address);
+    }
+  }
+  for (int i = 0; i < peerCount; i++) {
+    Peer p;
+    p.address = busMasterId + slaveCount + 1 + i;
+    busMasters |= (1U << p.address) | (1U << busMasterId);
+    foldSlaves |= (1U << p.address);
+    peers.push_back(p);
+  }
+
+  if (analyzerFile != NULL) {
+    if (peers.empty()) {
+      fprintf(stderr, "The analyzer needs other masters (-M) to make some traffic\n");
+      return 2;
+    }
+    analyzerOut = fopen(analyzerFile, "wb");
+    if (analyzerOut == NULL) {
+      perror(analyzerFile);
+      return 2;
+    }
+    busMasters &= ~(1U << busMasterId);
+    startBusMonitor();
+    peerGotToken(peers[0], 0);
+    eventRate = 0;
+  }
+
+  std::exponential_distribution<double> interval(eventRate);
+  uint64_t end = (uint64_t)(duration * 1e6);
+  uint64_t nextEvent = eventRate > 0 ? (uint64_t)(interval(rng) * 1e6) : end;
+  std::exponential_distribution<double> feedbackInterval(feedbackRate * slaveCount);
+  uint64_t nextFeedback = feedbackRate > 0 ? (uint64_t)(feedbackInterval(rng) * 1e6) : end;
+  uint64_t revive = reviveTime > 0 ? (uint64_t)(reviveTime * 1e6) : end;
+  uint64_t peerDies = (peerCount > 0 && peerDeath > 0) ? (uint64_t)(peerDeath * 1e6) : end;
+  uint64_t peerReturns = (peerCount > 0 && peerRevive > 0) ? (uint64_t)(peerRevive * 1e6) : end;
+  while (now < end) {
+    if (now >= revive) {
+      for (Slave& s : slaves) {
+        s.alive = true;
+      }
+      revive = end;
+    }
+    if (now >= peerDies) {
+      killPeer(peers[0]);
+      peerDies = end;
+    }
+    if (now >= peerReturns) {
+      peers[0].alive = true;
+      peerReturns = end;
+    }
+    while (nextEvent <= now) {
+      queueEvent(nextEvent);
+      nextEvent += (uint64_t)(interval(rng) * 1e6);
+    }
+    while (nextFeedback <= now) {
+      changeFeedback();
+      nextFeedback += (uint64_t)(feedbackInterval(rng) * 1e6);
+    }
+    updateTime();
+    transmitFrames();
+    run(now);
+    observe();
+    now += loopTime;
+    run(now);
+  }
+  report();
+  if (analyzerOut != NULL) {
+    fclose(analyzerOut);
+  }
+  return 0;
+}
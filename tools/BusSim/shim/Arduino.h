@@ -0,0 +1,99 @@
+/**
+ * Minimal host-side replacement of the Arduino core, just enough to compile the RS485 parts of the sketches.
+ * Time is virtual: millis() and micros() return the simulator's clock, and delayMicroseconds() advances it.
+ * Pin writes are forwarded to the simulator, which watches the RS485 direction pin.
+ */
+#ifndef __bussim_arduino_h__
+#define __bussim_arduino_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+template<typename A, typename B> constexpr auto max(A a, B b) -> decltype(true ? A() : B()) { return a > b ? a : b; }
+template<typename A, typename B> constexpr auto min(A a, B b) -> decltype(true ? A() : B()) { return a < b ? a : b; }
+
+typedef char __FlashStringHelper;
+#define F(s) (s)
+#define PROGMEM
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder);
+void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val);
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+char* itoa(int value, char* str, int base);
+
+/**
+ * Serial console. Output of the firmware is discarded unless the simulator runs verbose.
+ */
+class SimSerial {
+  size_t printNumber(unsigned long n, int base);
+  size_t printSigned(long n, int base);
+
+  public:
+  void begin(unsigned long) {}
+  int available() { return 0; }
+  int read() { return -1; }
+  int availableForWrite() { return 64; }
+
+  size_t write(uint8_t c);
+  size_t write(const char* s);
+  size_t write(const uint8_t* buf, size_t len);
+
+  size_t print(const char* s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return printNumber(n, base); }
+  size_t print(int n, int base = DEC) { return printSigned(n, base); }
+  size_t print(unsigned int n, int base = DEC) { return printNumber(n, base); }
+  size_t print(long n, int base = DEC) { return printSigned(n, base); }
+  size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+  size_t print(double d, int digits = 2);
+
+  size_t println() { return write("\r\n"); }
+  template<typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template<typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+};
+
+extern SimSerial Serial;
+
+#endif
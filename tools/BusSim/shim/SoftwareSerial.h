@@ -0,0 +1,25 @@
+/**
+ * The RS485 transceiver port. Instead of bit-banging a pin, bytes go to the simulated wire;
+ * write() blocks (advances the virtual clock) for one character time, like the real library does.
+ */
+#ifndef __bussim_softwareserial_h__
+#define __bussim_softwareserial_h__
+
+#include "Arduino.h"
+
+class SoftwareSerial {
+  public:
+  SoftwareSerial(uint8_t receivePin, uint8_t transmitPin, bool inverseLogic = false) {}
+
+  void begin(long speed);
+  bool listen() { return true; }
+  bool isListening() { return true; }
+  bool overflow();
+
+  int available();
+  int peek();
+  int read();
+  size_t write(uint8_t b);
+};
+
+#endif